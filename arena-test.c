@@ -0,0 +1,157 @@
+#include <stdio.h>
+
+#include "src/arena.h"
+#include "src/array.h"
+#include "src/buffer.h"
+#include "src/string.h"
+
+typedef struct Numbers {
+    ArrayHeader header;
+    u32        *buffer;
+} Numbers;
+
+#define MEBI_BYTE 1048576
+
+/// Typing a 1 MiB cell a char at a time, a newline every 80
+void TypeCell(void) {
+    Arena     arena = {0};
+    GapBuffer input = {0};
+    for (u32 i = 0; i < MEBI_BYTE; i += 1) {
+        GapBufferInsertChar(&input, &arena, i, i % 80 == 79 ? '\n' : 'a');
+    }
+    u32 live = input.cap + input.newlines.header.cap * sizeof(u32);
+    printf("cell:    %7u bytes live, arena high-water mark %lu\n", live,
+           (unsigned long)arena.high_water);
+    // the buffer and the newline index take turns at the end of the arena,
+    // what they leave behind is less than what they hold
+    assert(arena.high_water <= 2 * live);
+    ArenaFree(&arena);
+}
+
+/// Growing a string alone in its arena never copies
+void AppendString(void) {
+    Arena  arena = {0};
+    String s = {0};
+    for (u32 i = 0; i < MEBI_BYTE; i += 1) {
+        StringAppendChar(&s, &arena, 'a');
+    }
+    printf("string:  %7u bytes live, arena high-water mark %lu\n", s.len,
+           (unsigned long)arena.high_water);
+    assert(arena.high_water == s.cap);
+    ArenaFree(&arena);
+}
+
+/// History: entries and the array of them share an arena
+void FillHistory(void) {
+    Arena   arena = {0};
+    Numbers history = {0};
+    String  entry = S("for i in range(10):\n    print(i)");
+    u32     live = 0;
+    while (live < MEBI_BYTE) {
+        String copy = StringCopy(&entry, &arena);
+        ArrayPush(&history, &arena, copy.cap);
+        live += copy.cap;
+    }
+    live += history.header.cap * sizeof(u32);
+    printf("history: %7u bytes live, arena high-water mark %lu\n", live,
+           (unsigned long)arena.high_water);
+    assert(arena.high_water <= 2 * live);
+    ArenaFree(&arena);
+}
+
+/// Allocations past a chunk start the next one, aligned ones stay aligned
+void GrowChunks(void) {
+    Arena arena = {0};
+    ArenaAlloc(&arena, 3);
+    u8 *aligned = ArenaAllocAligned(&arena, 64, 64);
+    assert((uintptr_t)aligned % 64 == 0);
+
+    // pages are only backed when touched, so this costs no memory
+    u64 huge = ARENA_CHUNK_RESERVE + 1;
+    u8 *big = ArenaAlloc(&arena, huge);
+    big[0] = 1, big[huge - 1] = 1;
+    assert(arena.chunk->prev != NULL && arena.allocated == huge);
+    printf("chunks:  %7lu bytes in a chunk of their own\n", (unsigned long)huge);
+
+    ArenaReset(&arena);
+    assert(arena.chunk->prev == NULL && arena.allocated == 0);
+    ArenaFree(&arena);
+}
+
+/// Edits in one cell: what each key needs only for a moment is rewound
+void RewindScopes(void) {
+    Arena arena = {0};
+    ArenaAlloc(&arena, 100);
+    u64 kept = arena.allocated;
+    for (u32 key = 0; key < 100000; key += 1) {
+        ArenaScope scope = ArenaMark(&arena);
+        String     indented = {0};
+        StringAppendRaw(&indented, &arena, "\n        ");
+        ArenaRewind(&arena, scope);
+    }
+    printf("scratch: %7lu bytes live after 100000 keys\n", (unsigned long)arena.allocated);
+    assert(arena.allocated == kept);
+
+    // rewinding past a chunk boundary unmaps the chunks in between
+    ArenaScope scope = ArenaMark(&arena);
+    ArenaAlloc(&arena, ARENA_CHUNK_RESERVE);
+    ArenaRewind(&arena, scope);
+    assert(arena.chunk->prev == NULL && arena.allocated == kept);
+    ArenaFree(&arena);
+}
+
+/// After a big cell only the warm reserve stays resident
+void ReleasePages(void) {
+    Arena arena = {0};
+    u8   *cell = ArenaAlloc(&arena, 64 * MEBI_BYTE);
+    memset(cell, 1, 64 * MEBI_BYTE);
+    ArenaReset(&arena);
+    assert(arena.high_water == ARENA_WARM_RESERVE);
+
+    // released pages read back as zeros, the reserve kept its bytes
+    cell = ArenaAlloc(&arena, 64 * MEBI_BYTE);
+    assert(cell[ARENA_WARM_RESERVE - 1] == 1 && cell[ARENA_WARM_RESERVE + ARENA_PAGE_SIZE] == 0);
+    printf("release: %7lu bytes kept resident after a reset\n", (unsigned long)ARENA_WARM_RESERVE);
+
+    // under pressure only trims give the reserve back, resets every frame keep it
+    ArenaPolicy.under_pressure = true;
+    ArenaReset(&arena);
+    assert(arena.high_water == ARENA_WARM_RESERVE);
+    ArenaTrim(&arena);
+    ArenaPolicy.under_pressure = false;
+    assert(arena.high_water == 0);
+    ArenaFree(&arena);
+}
+
+/// Multiline snippets keep their shape wherever the cursor is, dedents too
+void IndentLines(void) {
+    Arena  arena = {0};
+    String snippet = S("if a:\n    b\nc"), before = S("");
+    String out = StringIndentLines(&snippet, &arena, &before);
+    assert(out.len == snippet.len && memcmp(out.buffer, snippet.buffer, out.len) == 0);
+
+    // re-based onto the cursor's level, the first line's own spaces included
+    snippet = S("  if a:\n      b\n  c\nd"), before = S("    ");
+    char *nested = "  if a:\n          b\n      c\n    d";
+    out = StringIndentLines(&snippet, &arena, &before);
+    assert(out.len == strlen(nested) && memcmp(out.buffer, nested, out.len) == 0);
+
+    // a typed newline, a level deeper after the ':'
+    snippet = S("\n"), before = S("    for i in x:");
+    out = StringIndentLines(&snippet, &arena, &before);
+    assert(out.len == 9 && memcmp(out.buffer, "\n        ", 9) == 0);
+    before = S("    y = 1");
+    out = StringIndentLines(&snippet, &arena, &before);
+    assert(out.len == 5 && memcmp(out.buffer, "\n    ", 5) == 0);
+    ArenaFree(&arena);
+}
+
+int main() {
+    TypeCell();
+    AppendString();
+    FillHistory();
+    GrowChunks();
+    RewindScopes();
+    ReleasePages();
+    IndentLines();
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "src/scan.h"
+
+/// Long enough for a few AVX2 chunks and the tails after them
+#define MAX_LEN   200
+#define MAX_ALIGN 32
+
+#define BENCH_LEN (16u << 20)
+
+/// Bytes the scans tell apart, the ones past ASCII are negative chars
+static char Alphabet[] = {' ', ' ',  ' ', '\n',       '\t',
+                          '\r', '\v', '\f', 'a', ':', (char)0x80, (char)0xFF};
+
+typedef struct Kernels {
+    char *name;
+    u32 (*count)(char *, u32, char);
+    u32 (*nth)(char *, u32, u32, char);
+    u32 (*leading)(char *, u32, char);
+    u32 (*first_not_space)(char *, u32);
+    u32 (*trim_right)(char *, u32);
+} Kernels;
+
+static Kernels Scalar = {"scalar", ScanCountScalar, ScanNthScalar, ScanLeadingScalar,
+                         ScanFirstNotSpaceScalar, ScanTrimRightScalar};
+#ifdef SCAN_SIMD
+static Kernels Sse2 = {"sse2", ScanCountSse2, ScanNthSse2, ScanLeadingSse2,
+                       ScanFirstNotSpaceSse2, ScanTrimRightSse2};
+static Kernels Avx2 = {"avx2", ScanCountAvx2, ScanNthAvx2, ScanLeadingAvx2,
+                       ScanFirstNotSpaceAvx2, ScanTrimRightAvx2};
+#endif
+
+/// Random bytes, or a run of spaces with random bytes around it so the
+/// scans that stop at the first mismatch get to go far
+void Fill(char *buffer, u32 len, u32 pattern) {
+    for (u32 i = 0; i < len; i += 1)
+        buffer[i] = Alphabet[rand() % sizeof(Alphabet)];
+    if (pattern == 0 || len == 0) return;
+
+    u32 from = pattern == 1 ? 0 : rand() % len;
+    u32 to = pattern == 2 ? len : from + rand() % (len - from + 1);
+    memset(buffer + from, ' ', to - from);
+}
+
+void Check(Kernels *kernels, char *buffer, u32 len) {
+    char needles[] = {'\n', ' ', (char)0x80};
+    for (u32 i = 0; i < sizeof(needles); i += 1) {
+        char needle = needles[i];
+        u32  count = ScanCountScalar(buffer, len, needle);
+        assert(kernels->count(buffer, len, needle) == count);
+        for (u32 n = 1; n <= count + 1; n += 1) {
+            u32 nth = ScanNthScalar(buffer, len, n, needle);
+            assert(kernels->nth(buffer, len, n, needle) == nth);
+        }
+        assert(kernels->leading(buffer, len, needle) == ScanLeadingScalar(buffer, len, needle));
+    }
+    // the indentation level is the leading spaces
+    assert(kernels->leading(buffer, len, ' ') == ScanLeadingScalar(buffer, len, ' '));
+    assert(kernels->first_not_space(buffer, len) == ScanFirstNotSpaceScalar(buffer, len));
+    assert(kernels->trim_right(buffer, len) == ScanTrimRightScalar(buffer, len));
+}
+
+/// Every length at every alignment, against the scalar versions
+void Agree(Kernels *kernels) {
+    static char memory[MAX_LEN + MAX_ALIGN];
+    for (u32 len = 0; len <= MAX_LEN; len += 1) {
+        for (u32 align = 0; align < MAX_ALIGN; align += 1) {
+            for (u32 pattern = 0; pattern < 4; pattern += 1) {
+                char *buffer = memory + align;
+                Fill(buffer, len, pattern);
+                Check(kernels, buffer, len);
+            }
+        }
+    }
+    printf("%-6s agrees with scalar on lengths 0-%u at %u alignments\n", kernels->name, MAX_LEN,
+           MAX_ALIGN);
+}
+
+double Seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// Prints the throughput in MB/s of what `scan` goes over in `len` bytes
+#define BENCH(kernels, label, len, scan)                                                           \
+    do {                                                                                           \
+        volatile u32 sink = 0;                                                                     \
+        double       start = Seconds();                                                            \
+        for (u32 ___round = 0; ___round < 8; ___round += 1)                                        \
+            sink += (scan);                                                                        \
+        double elapsed = Seconds() - start;                                                        \
+        printf("%-6s %-16s %8.0f MB/s\n", (kernels)->name, label,                                  \
+               8.0 * (len) / elapsed / 1e6);                                                       \
+        (void)sink;                                                                                \
+    } while (0)
+
+/// 16 MB of 80-column lines. The scans that stop at the first char they
+/// don't skip run over blank lines, and leading spaces over an indentation
+void Bench(Kernels *kernels, char *text, char *blank, char *indent) {
+    u32 lines = BENCH_LEN / 80;
+    BENCH(kernels, "count", BENCH_LEN, kernels->count(text, BENCH_LEN, '\n'));
+    BENCH(kernels, "nth newline", BENCH_LEN, kernels->nth(text, BENCH_LEN, lines, '\n'));
+    BENCH(kernels, "first not space", BENCH_LEN, kernels->first_not_space(blank, BENCH_LEN));
+    BENCH(kernels, "trim right", BENCH_LEN, kernels->trim_right(blank, BENCH_LEN));
+    BENCH(kernels, "indentation", BENCH_LEN, kernels->leading(indent, BENCH_LEN, ' '));
+}
+
+int main() {
+    srand(1);
+#ifdef SCAN_SIMD
+    Agree(&Sse2);
+    if (ScanHasAvx2()) Agree(&Avx2);
+#endif
+
+    char *text = malloc(BENCH_LEN), *blank = malloc(BENCH_LEN), *indent = malloc(BENCH_LEN);
+    char *line = "    for i in range(10): print(i, i * i, 'some text to fill the line up with')";
+    for (u32 i = 0; i < BENCH_LEN; i += 1) {
+        u32 column = i % 80;
+        text[i] = column == 79 ? '\n' : column < strlen(line) ? line[column] : ' ';
+        blank[i] = column == 79 ? '\n' : ' ';
+        indent[i] = ' ';
+    }
+    Bench(&Scalar, text, blank, indent);
+#ifdef SCAN_SIMD
+    Bench(&Sse2, text, blank, indent);
+    if (ScanHasAvx2()) Bench(&Avx2, text, blank, indent);
+#endif
+    free(text), free(blank), free(indent);
+}
@@ -1,38 +1,286 @@
 #pragma once
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "core.h"
 
+/// Address space a chunk reserves. Pages are backed only once touched,
+/// so this costs nothing until the arena actually fills it
+#define ARENA_CHUNK_RESERVE (4ull << 30)
+
+/// Chunks from the hugetlb pool are taken from it up front, these start smaller
+#define ARENA_HUGE_TLB_CHUNK (64ull << 20)
+
+#define ARENA_HUGE_PAGE_SIZE (2ull << 20)
+
+/// How far into a chunk `ArenaHugePages` kicks in, small arenas keep small pages
+#define ARENA_HUGE_PAGE_THRESHOLD (8ull << 20)
+
+/// What `ArenaRealloc` aligns new blocks to, same as malloc
+#define ARENA_DEFAULT_ALIGN _Alignof(max_align_t)
+
+/// Room for the chunk header, the memory after it is cache line aligned
+#define ARENA_CHUNK_HEADER 64
+
+#define ARENA_PAGE_SIZE 4096ull
+
+/// Bytes at the start of an arena that stay resident across resets, so the
+/// next cell doesn't fault them in again. The pages past them go back to the kernel
+#define ARENA_WARM_RESERVE (1ull << 20)
+
+/// Overrides `ARENA_WARM_RESERVE`, in KiB
+#define ARENA_RESERVE_ENV "DY_ARENA_RESERVE"
+
+/// Share of the last 10s some task stalled on memory, in percent, past which
+/// the system counts as under pressure and trims keep no reserve.
+/// `DY_ARENA_PRESSURE=0` always releases everything
+#define ARENA_PRESSURE_AVG10 10.0
+#define ARENA_PRESSURE_ENV   "DY_ARENA_PRESSURE"
+#define ARENA_PRESSURE_FILE  "/proc/pressure/memory"
+
+typedef enum ArenaFlags {
+    /// Transparent huge pages past the first `ARENA_HUGE_PAGE_THRESHOLD` bytes
+    ArenaHugePages = 1 << 0,
+
+    /// Chunks from the hugetlb pool, regular pages when it's short
+    ArenaHugeTlb = 1 << 1,
+} ArenaFlags;
+
+/// Start of every mapping an arena made, the chunks before the current one are full
+typedef struct ArenaChunk {
+    struct ArenaChunk *prev;
+
+    /// Bytes mapped, this header included, in pages of `page_size`
+    u64 size, page_size;
+
+    /// The arena's `high_water` while the chunk isn't the current one
+    u64 high_water;
+} ArenaChunk;
+
+/// How resets hand memory back to the kernel, shared by all arenas
+typedef struct ArenaReleasePolicy {
+    u64    warm_reserve;
+    double pressure_avg10;
+
+    /// Last seen by `ArenaPolicyCheckPressure`, trims release everything while it holds
+    bool under_pressure;
+} ArenaReleasePolicy;
+
+static ArenaReleasePolicy ArenaPolicy = {
+    .warm_reserve = ARENA_WARM_RESERVE,
+    .pressure_avg10 = ARENA_PRESSURE_AVG10,
+};
+
+/// Bump allocator over chunks of reserved address space.
+///
+/// The current chunk holds `ptr[0..allocated)` out of `bound` bytes, an
+/// allocation that doesn't fit starts the next one. Until an arena outgrows
+/// its first chunk its allocations are contiguous. The flags are set before
+/// the first allocation, which maps the first chunk.
+///
+/// `high_water` is how far into the current chunk it ever got, the pages
+/// below it may be resident. A reset releases those past the warm reserve
 typedef struct Arena {
-    u8 *ptr;
-    u32 bound, allocated;
+    u8         *ptr;
+    u64         bound, allocated, high_water;
+    ArenaChunk *chunk;
+    u32         flags;
 } Arena;
 
-Arena ArenaNew(void) {
-    u32 GibiByte = 1073741824;
-    u8 *ptr = mmap(0, 2 * GibiByte, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    assert(ptr && "Failed to `mmap` 2 GibiBytes bro 😭");
-    return (Arena){.ptr = ptr, .bound = 2 * GibiByte};
+/// Where an arena was at, to drop whatever comes after it
+typedef struct ArenaScope {
+    ArenaChunk *chunk;
+    u64         allocated;
+} ArenaScope;
+
+void  ArenaPushChunk(Arena *this, u64 min_size);
+void *ArenaAlloc(Arena *this, u64 size);
+void *ArenaAllocAligned(Arena *this, u64 size, u64 align);
+bool  ArenaExtend(Arena *this, void *ptr, u64 old_size, u64 new_size);
+void *ArenaRealloc(Arena *this, void *ptr, u64 old_size, u64 new_size);
+void  ArenaPopChunk(Arena *this);
+void  ArenaReset(Arena *this);
+void  ArenaTrim(Arena *this);
+void  ArenaRelease(Arena *this, u64 keep);
+void  ArenaFree(Arena *this);
+
+void ArenaPolicyLoad(void);
+bool ArenaPolicyCheckPressure(void);
+
+ArenaScope ArenaMark(Arena *this);
+void       ArenaRewind(Arena *this, ArenaScope scope);
+
+/// Maps a chunk that fits at least `min_size` bytes and makes it the current one
+void ArenaPushChunk(Arena *this, u64 min_size) {
+    i32 prot = PROT_READ | PROT_WRITE;
+    i32 flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    u64 need = min_size + ARENA_CHUNK_HEADER;
+    u8 *base = MAP_FAILED;
+    u64 size = 0, page_size = ARENA_PAGE_SIZE;
+
+    // no MAP_NORESERVE: hugetlb pages it didn't reserve would SIGBUS on first touch
+    if (this->flags & ArenaHugeTlb) {
+        size = need > ARENA_HUGE_TLB_CHUNK ? need : ARENA_HUGE_TLB_CHUNK;
+        size = (size + ARENA_HUGE_PAGE_SIZE - 1) & ~(ARENA_HUGE_PAGE_SIZE - 1);
+        base = mmap(0, size, prot, flags | MAP_HUGETLB, -1, 0);
+        page_size = ARENA_HUGE_PAGE_SIZE;
+    }
+    if (base == MAP_FAILED) {
+        page_size = ARENA_PAGE_SIZE;
+        size = need > ARENA_CHUNK_RESERVE ? need : ARENA_CHUNK_RESERVE;
+        size = (size + ARENA_HUGE_PAGE_SIZE - 1) & ~(ARENA_HUGE_PAGE_SIZE - 1);
+        base = mmap(0, size, prot, flags | MAP_NORESERVE, -1, 0);
+        assert(base != MAP_FAILED && "failed to reserve a chunk for the arena");
+        if ((this->flags & ArenaHugePages) && size > ARENA_HUGE_PAGE_THRESHOLD) {
+            // only a hint, the kernel may not have THP enabled
+            madvise(base + ARENA_HUGE_PAGE_THRESHOLD, size - ARENA_HUGE_PAGE_THRESHOLD,
+                    MADV_HUGEPAGE);
+        }
+    }
+
+    if (this->chunk) this->chunk->high_water = this->high_water;
+    ArenaChunk *chunk = (ArenaChunk *)base;
+    *chunk = (ArenaChunk){.prev = this->chunk, .size = size, .page_size = page_size};
+    this->chunk = chunk;
+    this->ptr = base + ARENA_CHUNK_HEADER;
+    this->bound = size - ARENA_CHUNK_HEADER;
+    this->allocated = 0;
+    this->high_water = 0;
 }
 
-// TODO: Aligned alloc
-void *ArenaAlloc(Arena *this, u32 size) {
-    if (this->ptr == NULL) {
-        *this = ArenaNew();
+/// Takes `size` bytes right after the previous allocation, unaligned
+void *ArenaAlloc(Arena *this, u64 size) {
+    if (this->ptr == NULL || size > this->bound - this->allocated) {
+        ArenaPushChunk(this, size);
     }
-    if (this->allocated + size >= this->bound) assert(false && "Arena 2GiB limit exceeded. How?");
     u8 *ptr = this->ptr + this->allocated;
     this->allocated += size;
+    if (this->allocated > this->high_water) this->high_water = this->allocated;
     return ptr;
 }
 
+/// Takes `size` bytes starting at a multiple of `align`, a power of two
+void *ArenaAllocAligned(Arena *this, u64 size, u64 align) {
+    assert(align != 0 && (align & (align - 1)) == 0 && "alignment should be a power of two");
+    u64 pad = this->ptr ? -(uintptr_t)(this->ptr + this->allocated) & (align - 1) : 0;
+    if (this->ptr == NULL || pad + size > this->bound - this->allocated) {
+        ArenaPushChunk(this, size + align);
+        pad = -(uintptr_t)this->ptr & (align - 1);
+    }
+    this->allocated += pad;
+    return ArenaAlloc(this, size);
+}
+
+/// Grows the block at `ptr` to `new_size` if it's the last one allocated,
+/// so nothing has to be copied. Returns whether it did
+bool ArenaExtend(Arena *this, void *ptr, u64 old_size, u64 new_size) {
+    if (ptr == NULL || (u8 *)ptr + old_size != this->ptr + this->allocated) return false;
+    if (new_size - old_size > this->bound - this->allocated) return false;
+    ArenaAlloc(this, new_size - old_size);
+    return true;
+}
+
+/// Resizes the block at `ptr`, in place when it's the last one allocated.
+/// Otherwise the contents move to a new block and the old one is left behind,
+/// so callers should grow geometrically
+void *ArenaRealloc(Arena *this, void *ptr, u64 old_size, u64 new_size) {
+    if (new_size <= old_size) return ptr;
+    if (ArenaExtend(this, ptr, old_size, new_size)) return ptr;
+
+    void *new_ptr = ArenaAllocAligned(this, new_size, ARENA_DEFAULT_ALIGN);
+    if (ptr && old_size) memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
+}
+
+/// Unmaps the current chunk, the one before it becomes the current one
+void ArenaPopChunk(Arena *this) {
+    ArenaChunk *prev = this->chunk->prev;
+    i32         status = munmap(this->chunk, this->chunk->size);
+    assert(status == 0 && "failed to unmap arena's chunk");
+
+    this->chunk = prev;
+    this->ptr = prev ? (u8 *)prev + ARENA_CHUNK_HEADER : NULL;
+    this->bound = prev ? prev->size - ARENA_CHUNK_HEADER : 0;
+    this->allocated = this->bound;
+    this->high_water = prev ? prev->high_water : 0;
+}
+
+/// Marks the end of the arena, `ArenaRewind` takes it back there
+ArenaScope ArenaMark(Arena *this) {
+    return (ArenaScope){.chunk = this->chunk, .allocated = this->allocated};
+}
+
+/// Drops everything allocated since `scope` was marked, the chunks mapped
+/// since then are unmapped. An arena that was empty keeps its first chunk
+void ArenaRewind(Arena *this, ArenaScope scope) {
+    while (this->chunk != scope.chunk && (scope.chunk || this->chunk->prev)) {
+        assert(this->chunk && "the scope was marked in another arena, or rewound past");
+        ArenaPopChunk(this);
+    }
+    this->allocated = scope.allocated;
+}
+
+/// Drops everything, the chunks past the first are unmapped. The pages past
+/// the warm reserve go back to the kernel, the reserve stays whatever the
+/// pressure: arenas reset every frame would fault it right back in
 void ArenaReset(Arena *this) {
-    this->allocated = 0;
+    ArenaRewind(this, (ArenaScope){0});
+    ArenaRelease(this, ArenaPolicy.warm_reserve);
+}
+
+/// Drops everything like `ArenaReset`, under memory pressure the warm reserve
+/// too. For the arenas reset once a cell, there's time to fault it back in
+void ArenaTrim(Arena *this) {
+    ArenaRewind(this, (ArenaScope){0});
+    ArenaRelease(this, ArenaPolicy.under_pressure ? 0 : ArenaPolicy.warm_reserve);
+}
+
+/// Gives the pages of the current chunk past its first `keep` bytes back to
+/// the kernel, if the arena ever touched them. MADV_DONTNEED rather than
+/// MADV_FREE: RSS drops right away, the freed pages don't linger in it
+/// until the kernel gets around to them
+void ArenaRelease(Arena *this, u64 keep) {
+    if (this->chunk == NULL) return;
+    if (keep < this->allocated) keep = this->allocated;
+    if (this->high_water <= keep) return;
+
+    u64 page_size = this->chunk->page_size;
+    u64 from = ((uintptr_t)this->ptr + keep + page_size - 1) & ~(page_size - 1);
+    u64 to = ((uintptr_t)this->ptr + this->high_water + page_size - 1) & ~(page_size - 1);
+    if (from < to) madvise((void *)from, to - from, MADV_DONTNEED);
+    this->high_water = keep;
 }
 
 void ArenaFree(Arena *this) {
-    i32 status = munmap(this->ptr, this->bound);
-    assert(status == 0 && "failed to unmap arena's buffer");
+    while (this->chunk)
+        ArenaPopChunk(this);
+    this->allocated = 0;
+}
+
+/// Reads the overrides of the release policy from the environment
+void ArenaPolicyLoad(void) {
+    char *reserve = getenv(ARENA_RESERVE_ENV);
+    if (reserve && *reserve) ArenaPolicy.warm_reserve = strtoull(reserve, NULL, 10) * 1024;
+    char *pressure = getenv(ARENA_PRESSURE_ENV);
+    if (pressure && *pressure) ArenaPolicy.pressure_avg10 = strtod(pressure, NULL);
+    ArenaPolicy.under_pressure = ArenaPolicy.pressure_avg10 <= 0;
+}
+
+/// Looks at the kernel's memory pressure stall info, for the resets that
+/// follow. Without PSI the system never counts as under pressure
+bool ArenaPolicyCheckPressure(void) {
+    if (ArenaPolicy.pressure_avg10 <= 0) return ArenaPolicy.under_pressure = true;
+
+    double avg10 = 0;
+    FILE  *file = fopen(ARENA_PRESSURE_FILE, "r");
+    if (file) {
+        if (fscanf(file, "some avg10=%lf", &avg10) != 1) avg10 = 0;
+        fclose(file);
+    }
+    return ArenaPolicy.under_pressure = avg10 >= ArenaPolicy.pressure_avg10;
 }
@@ -20,13 +20,9 @@ typedef struct ArrayHeader {
             (array)->header.cap != 0 ? (array)->header.cap : INITIAL_CAP;                          \
         if (___array_additional_cap < additional) ___array_additional_cap = additional;            \
         u32 ___array_new_cap = (array)->header.cap + ___array_additional_cap;                      \
-        void *___array_new_buffer =                                                                \
-            ArenaAlloc(arena, ___array_new_cap * sizeof(*(array)->buffer));                        \
-        if ((array)->header.len != 0 && (array)->buffer) {                                         \
-            memcpy(___array_new_buffer, (array)->buffer,                                           \
-                   (array)->header.len * sizeof(*(array)->buffer));                                \
-        }                                                                                          \
-        (array)->buffer = ___array_new_buffer;                                                     \
+        (array)->buffer = ArenaRealloc(arena, (array)->buffer,                                     \
+                                       (array)->header.cap * sizeof(*(array)->buffer),             \
+                                       ___array_new_cap * sizeof(*(array)->buffer));               \
         (array)->header.cap = ___array_new_cap;                                                    \
     } while (0);
 
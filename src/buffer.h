@@ -0,0 +1,294 @@
+#pragma once
+
+#include <assert.h>
+#include <memory.h>
+
+#include "arena.h"
+#include "array.h"
+#include "core.h"
+#include "scan.h"
+#include "string.h"
+
+/// Smallest gap a growing buffer starts with
+#define GAP_BUFFER_INITIAL_CAP 64
+
+typedef struct GapBufferNewlines {
+    ArrayHeader header;
+    u32        *buffer;
+} GapBufferNewlines;
+
+/// Text being edited, with a gap of free space where the edits happen.
+///
+/// The text is `buffer[0..gap_start)` followed by `buffer[gap_end..cap)`.
+/// Inserting or removing at the gap is O(1), moving it costs the distance
+/// it moves. Edits come at the cursor, so the gap mostly stays where it is
+typedef struct GapBuffer {
+    char *buffer;
+    u32   gap_start, gap_end, cap;
+
+    /// Where the newlines sit in `buffer`, in order, the first `newlines_before`
+    /// of them before the gap. Edits at the gap leave the text around it in
+    /// place, so these only change when the gap moves over them or a newline
+    /// itself gets inserted or removed. Lines are found without scanning
+    GapBufferNewlines newlines;
+    u32               newlines_before;
+} GapBuffer;
+
+u32  GapBufferLen(GapBuffer *this);
+char GapBufferGetChar(GapBuffer *this, u32 index);
+void GapBufferMoveGap(GapBuffer *this, u32 index);
+void GapBufferEnsureGap(GapBuffer *this, Arena *arena, u32 additional);
+void GapBufferAddNewlines(GapBuffer *this, Arena *arena, char *text, u32 len);
+
+void GapBufferInsert(GapBuffer *this, Arena *arena, u32 index, char *text, u32 len);
+void GapBufferInsertChar(GapBuffer *this, Arena *arena, u32 index, char c);
+char GapBufferRemoveChar(GapBuffer *this, u32 index);
+void GapBufferRemove(GapBuffer *this, u32 index, u32 len);
+void GapBufferReplace(GapBuffer *this, Arena *arena, u32 index, u32 len, char *text, u32 text_len);
+void GapBufferClear(GapBuffer *this);
+void GapBufferReset(GapBuffer *this);
+
+u32    GapBufferLineCount(GapBuffer *this);
+u32    GapBufferLineStart(GapBuffer *this, u32 n);
+u32    GapBufferLineOf(GapBuffer *this, u32 index);
+u32    GapBufferLineLen(GapBuffer *this, u32 n);
+u32    GapBufferLineIndentation(GapBuffer *this, u32 n);
+bool   GapBufferIsSpace(GapBuffer *this);
+String GapBufferSlice(GapBuffer *this, u32 from, u32 to);
+String GapBufferNthLine(GapBuffer *this, u32 n);
+String GapBufferLineFrom(GapBuffer *this, u32 n, u32 from);
+String GapBufferCopy(GapBuffer *this, Arena *arena);
+
+u32 GapBufferLen(GapBuffer *this) { return this->cap - (this->gap_end - this->gap_start); }
+
+char GapBufferGetChar(GapBuffer *this, u32 index) {
+    if (index >= GapBufferLen(this)) return 0;
+    if (index < this->gap_start) return this->buffer[index];
+    return this->buffer[index + this->gap_end - this->gap_start];
+}
+
+/// Puts the gap right before the `index`th char
+void GapBufferMoveGap(GapBuffer *this, u32 index) {
+    assert(index <= GapBufferLen(this));
+    u32 *newlines = this->newlines.buffer;
+    u32  gap_len = this->gap_end - this->gap_start;
+    if (index < this->gap_start) {
+        u32 len = this->gap_start - index;
+        memmove(this->buffer + this->gap_end - len, this->buffer + index, len);
+        while (this->newlines_before > 0 && newlines[this->newlines_before - 1] >= index) {
+            this->newlines_before -= 1;
+            newlines[this->newlines_before] += gap_len;
+        }
+        this->gap_start -= len;
+        this->gap_end -= len;
+    } else if (index > this->gap_start) {
+        u32 len = index - this->gap_start;
+        memmove(this->buffer + this->gap_start, this->buffer + this->gap_end, len);
+        while (this->newlines_before < ArrayLen(&this->newlines) &&
+               newlines[this->newlines_before] < this->gap_end + len) {
+            newlines[this->newlines_before] -= gap_len;
+            this->newlines_before += 1;
+        }
+        this->gap_start += len;
+        this->gap_end += len;
+    }
+}
+
+/// Grows the buffer to at least double its size, the text
+/// after the gap goes to the end of the new buffer. When the buffer is
+/// the last thing in the arena it grows in place and only that text moves
+void GapBufferEnsureGap(GapBuffer *this, Arena *arena, u32 additional) {
+    if (this->gap_end - this->gap_start >= additional) return;
+
+    u32 len = GapBufferLen(this);
+    u32 new_cap = this->cap != 0 ? this->cap * 2 : GAP_BUFFER_INITIAL_CAP;
+    if (new_cap < len + additional) new_cap = len + additional;
+
+    u32   after_len = this->cap - this->gap_end;
+    char *new_buffer = this->buffer;
+    if (ArenaExtend(arena, this->buffer, this->cap, new_cap)) {
+        memmove(new_buffer + new_cap - after_len, this->buffer + this->gap_end, after_len);
+    } else {
+        new_buffer = ArenaAlloc(arena, new_cap);
+        if (this->gap_start) memcpy(new_buffer, this->buffer, this->gap_start);
+        if (after_len) {
+            memcpy(new_buffer + new_cap - after_len, this->buffer + this->gap_end, after_len);
+        }
+    }
+
+    u32 moved = new_cap - this->cap;
+    for (u32 i = this->newlines_before; i < ArrayLen(&this->newlines); i += 1)
+        this->newlines.buffer[i] += moved;
+
+    this->buffer = new_buffer;
+    this->gap_end += moved;
+    this->cap = new_cap;
+}
+
+/// Indexes the newlines of `text`, which was just put right before the gap
+void GapBufferAddNewlines(GapBuffer *this, Arena *arena, char *text, u32 len) {
+    u32 count = ScanCount(text, len, '\n');
+    if (count == 0) return;
+
+    GapBufferNewlines *newlines = &this->newlines;
+    ArrayEnsureAdditionalCap(newlines, arena, count);
+    u32 *slot = newlines->buffer + this->newlines_before;
+    memmove(slot + count, slot, (ArrayLen(newlines) - this->newlines_before) * sizeof(u32));
+
+    u32 position = this->gap_start - len;
+    for (char *at = memchr(text, '\n', len); at; at = memchr(at + 1, '\n', text + len - at - 1))
+        *slot++ = position + (at - text);
+    newlines->header.len += count;
+    this->newlines_before += count;
+}
+
+void GapBufferInsert(GapBuffer *this, Arena *arena, u32 index, char *text, u32 len) {
+    if (len == 0) return;
+    GapBufferEnsureGap(this, arena, len);
+    GapBufferMoveGap(this, index);
+    memcpy(this->buffer + this->gap_start, text, len);
+    this->gap_start += len;
+    GapBufferAddNewlines(this, arena, text, len);
+}
+
+void GapBufferInsertChar(GapBuffer *this, Arena *arena, u32 index, char c) {
+    GapBufferEnsureGap(this, arena, 1);
+    GapBufferMoveGap(this, index);
+    this->buffer[this->gap_start] = c;
+    this->gap_start += 1;
+    if (c == '\n') GapBufferAddNewlines(this, arena, &c, 1);
+}
+
+char GapBufferRemoveChar(GapBuffer *this, u32 index) {
+    assert(index < GapBufferLen(this));
+    GapBufferMoveGap(this, index);
+    char c = this->buffer[this->gap_end];
+    this->gap_end += 1;
+    if (c == '\n') {
+        // the first one after the gap
+        u32 *slot = this->newlines.buffer + this->newlines_before;
+        u32  after = ArrayLen(&this->newlines) - this->newlines_before - 1;
+        memmove(slot, slot + 1, after * sizeof(u32));
+        this->newlines.header.len -= 1;
+    }
+    return c;
+}
+
+/// Removes [index, index + len)
+void GapBufferRemove(GapBuffer *this, u32 index, u32 len) {
+    assert(index + len <= GapBufferLen(this));
+    GapBufferMoveGap(this, index);
+
+    // the newlines removed are the first ones after the gap
+    u32  removed = 0;
+    u32  after = ArrayLen(&this->newlines) - this->newlines_before;
+    u32 *slot = this->newlines.buffer + this->newlines_before;
+    while (removed < after && slot[removed] < this->gap_end + len)
+        removed += 1;
+    if (removed) memmove(slot, slot + removed, (after - removed) * sizeof(u32));
+    this->newlines.header.len -= removed;
+    this->gap_end += len;
+}
+
+/// Swaps [index, index + len) for `text`. The removal leaves the gap right
+/// where the text goes, so it moves once for both
+void GapBufferReplace(GapBuffer *this, Arena *arena, u32 index, u32 len, char *text, u32 text_len) {
+    GapBufferRemove(this, index, len);
+    GapBufferInsert(this, arena, index, text, text_len);
+}
+
+/// Drops the text, the buffer is kept for the next one
+void GapBufferClear(GapBuffer *this) {
+    this->gap_start = 0;
+    this->gap_end = this->cap;
+    this->newlines.header.len = 0;
+    this->newlines_before = 0;
+}
+
+/// Forgets the text, along with the buffer: its arena is about to be reset
+void GapBufferReset(GapBuffer *this) { *this = (GapBuffer){0}; }
+
+u32 GapBufferLineCount(GapBuffer *this) { return ArrayLen(&this->newlines) + 1; }
+
+/// Index of the first char of line `n`, the length if there are fewer lines
+u32 GapBufferLineStart(GapBuffer *this, u32 n) {
+    if (n == 0) return 0;
+    if (n > ArrayLen(&this->newlines)) return GapBufferLen(this);
+    u32 newline = this->newlines.buffer[n - 1];
+    if (n > this->newlines_before) newline -= this->gap_end - this->gap_start;
+    return newline + 1;
+}
+
+/// Line the `index`th char is on, a binary search over the newlines
+u32 GapBufferLineOf(GapBuffer *this, u32 index) {
+    u32 low = 0, high = ArrayLen(&this->newlines);
+    while (low < high) {
+        u32 mid = low + (high - low) / 2;
+        if (GapBufferLineStart(this, mid + 1) <= index) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+u32 GapBufferLineLen(GapBuffer *this, u32 n) {
+    u32 start = GapBufferLineStart(this, n);
+    if (n + 1 >= GapBufferLineCount(this)) return GapBufferLen(this) - start;
+    return GapBufferLineStart(this, n + 1) - 1 - start;
+}
+
+/// Leading spaces of line `n`, in levels of 4
+u32 GapBufferLineIndentation(GapBuffer *this, u32 n) {
+    u32 start = GapBufferLineStart(this, n);
+    u32 len = GapBufferLineLen(this, n);
+    u32 spaces = 0;
+    while (spaces < len && GapBufferGetChar(this, start + spaces) == ' ')
+        spaces += 1;
+    return spaces / 4;
+}
+
+bool GapBufferIsSpace(GapBuffer *this) {
+    u32 after_len = this->cap - this->gap_end;
+    return ScanFirstNotSpace(this->buffer, this->gap_start) == this->gap_start &&
+           ScanFirstNotSpace(this->buffer + this->gap_end, after_len) == after_len;
+}
+
+/// Contiguous view of [from, to), valid until the next edit. If the gap
+/// sits inside the range it gets moved out, to whichever end is closer
+String GapBufferSlice(GapBuffer *this, u32 from, u32 to) {
+    assert(from <= to && to <= GapBufferLen(this));
+    if (from < this->gap_start && this->gap_start < to) {
+        GapBufferMoveGap(this, this->gap_start - from < to - this->gap_start ? from : to);
+    }
+    u32 offset = from < this->gap_start || from == to ? 0 : this->gap_end - this->gap_start;
+    if (this->buffer == NULL) return (String){0};
+    return (String){.buffer = this->buffer + from + offset, .len = to - from, .cap = to - from};
+}
+
+String GapBufferNthLine(GapBuffer *this, u32 n) {
+    u32 start = GapBufferLineStart(this, n);
+    return GapBufferSlice(this, start, start + GapBufferLineLen(this, n));
+}
+
+/// Line `n` with only its bytes from `from` on in place, the ones before may
+/// be the gap. The gap moves no further than `from`, instead of out of the line
+String GapBufferLineFrom(GapBuffer *this, u32 n, u32 from) {
+    u32 start = GapBufferLineStart(this, n);
+    u32 len = GapBufferLineLen(this, n);
+    assert(from <= len);
+    String rest = GapBufferSlice(this, start + from, start + len);
+    return (String){.buffer = rest.buffer - from, .len = len, .cap = len};
+}
+
+/// Copies the text out into a nul-terminated string
+String GapBufferCopy(GapBuffer *this, Arena *arena) {
+    u32    len = GapBufferLen(this);
+    String copy = {.buffer = ArenaAlloc(arena, len + 1), .len = len, .cap = len + 1};
+    u32    after_len = this->cap - this->gap_end;
+    if (this->gap_start) memcpy(copy.buffer, this->buffer, this->gap_start);
+    if (after_len) memcpy(copy.buffer + this->gap_start, this->buffer + this->gap_end, after_len);
+    copy.buffer[len] = '\0';
+    return copy;
+}
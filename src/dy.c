@@ -3,43 +3,101 @@
 #include <Python.h>
 
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 
 #include "arena.h"
 #include "core.h"
+#include "executor.h"
 #include "history.h"
 #include "string.h"
 #include "terminal.h"
 
+/// Everything the editor thread owns
+typedef struct Repl {
+    Terminal  terminal;
+    Executor *executor;
+
+    Arena input_arena;
+    Arena history_arena;
+
+    /// Copy of the submitted input that Python runs, so the
+    /// next one can be edited in the meantime
+    Arena cell_arena;
+} Repl;
+
+void *ReplEditor(void *arg) {
+    Repl *repl = arg;
+
+    // SIGINT has to reach the interpreter thread, where it
+    // interrupts blocking calls and raises `KeyboardInterrupt`
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    Terminal *terminal = &repl->terminal;
+    while (1) {
+        TerminalStartNewLine(terminal, &repl->input_arena);
+
+        i32 status = TerminalReadLine(terminal, &repl->input_arena, &repl->history_arena);
+        if (status == Eof) break;
+
+        // once per cell, these two give back their reserve too if memory is short
+        ArenaPolicyCheckPressure();
+        ArenaTrim(&repl->cell_arena);
+        String cell = GapBufferCopy(&terminal->input, &repl->cell_arena);
+        ExecutorSubmit(repl->executor, cell.buffer);
+
+        ArenaTrim(&repl->input_arena);
+        TerminalResetInput(terminal);
+        TerminalWaitExecution(terminal, repl->executor, &repl->input_arena);
+    }
+
+    ExecutorShutdown(repl->executor);
+    return NULL;
+}
+
 int main(void) {
     PyStatus pystatus;
     PyConfig config;
     PyConfig_InitPythonConfig(&config);
 
     config.isolated = 1;
+    ExecutorRegisterModule();
     pystatus = Py_InitializeFromConfig(&config);
     if (PyStatus_Exception(pystatus)) {
         goto exception;
     }
 
-    Arena input_arena = {0};
-    Arena history_arena = {0};
-    Terminal terminal = TerminalSetup();
-    while (1) {
-        TerminalStartNewLine(&terminal, &input_arena);
+    Executor executor;
+    ExecutorInit(&executor);
 
-        i32 status = TerminalReadLine(&terminal, &input_arena, &history_arena);
-        if (status == Eof) break;
+    ArenaPolicyLoad();
+    // these hold whole cells and the history, big pastes get huge pages
+    Repl repl = {
+        .terminal = TerminalSetup(),
+        .executor = &executor,
+        .input_arena = {.flags = ArenaHugePages},
+        .history_arena = {.flags = ArenaHugePages},
+        .cell_arena = {.flags = ArenaHugePages},
+    };
+    TerminalAttachExecutor(&repl.terminal, &executor);
 
-        PyRun_SimpleString(terminal.input.buffer);
+    pthread_t editor;
+    pthread_create(&editor, NULL, ReplEditor, &repl);
 
-        ArenaReset(&input_arena);
-        TerminalResetInput(&terminal);
+    char *cell;
+    while ((cell = ExecutorWaitCell(&executor))) {
+        PyRun_SimpleString(cell);
+        ExecutorFinish(&executor);
     }
+    pthread_join(editor, NULL);
 
-    /* we are exiting anyways; OS will reclaim pages */
-    // ArenaFree(&input_arena);
-    // ArenaFree(&history_arena);
+    ArenaFree(&repl.input_arena);
+    ArenaFree(&repl.history_arena);
+    ArenaFree(&repl.cell_arena);
     Py_FinalizeEx();
 
     return 0;
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "core.h"
+
+/// Upper bound of the file descriptors a loop can wait on
+#define EVENT_LOOP_MAX_SOURCES 8
+
+/// Waits on a set of file descriptors, sleeping until
+/// at least one of them is ready (or a timeout expires)
+typedef struct EventLoop {
+    struct pollfd sources[EVENT_LOOP_MAX_SOURCES];
+    u32           len;
+} EventLoop;
+
+u32  EventLoopAdd(EventLoop *this, i32 fd);
+u32  EventLoopAddSignal(EventLoop *this, i32 signo);
+bool EventLoopTakeSignal(EventLoop *this, u32 source);
+void EventLoopSetEnabled(EventLoop *this, u32 source, bool enabled);
+i32  EventLoopWait(EventLoop *this, i32 timeout_ms);
+bool EventLoopIsReadable(EventLoop *this, u32 source);
+bool EventLoopIsHangUp(EventLoop *this, u32 source);
+u64  EventLoopNowMs(void);
+
+/// Registers `fd` for readability and returns its source index
+u32 EventLoopAdd(EventLoop *this, i32 fd) {
+    assert(this->len < EVENT_LOOP_MAX_SOURCES && "too many event sources");
+    this->sources[this->len] = (struct pollfd){.fd = fd, .events = POLLIN};
+    return this->len++;
+}
+
+/// Stops (or resumes) polling a source without removing it,
+/// `poll` skips negative descriptors
+void EventLoopSetEnabled(EventLoop *this, u32 source, bool enabled) {
+    assert(source < this->len);
+    i32 *fd = &this->sources[source].fd;
+    if (enabled == (*fd < 0)) *fd = ~*fd;
+}
+
+/// Write ends of the self-pipes, indexed by signal number
+static i32 EventSignalPipes[NSIG];
+
+void EventSignalHandler(i32 signo) {
+    i32 saved_errno = errno;
+    u8  byte = signo;
+    (void)write(EventSignalPipes[signo], &byte, 1);
+    errno = saved_errno;
+}
+
+/// Delivers `signo` as a readable source through a self-pipe.
+/// Unlike blocking the signal for a signalfd, this leaves the signal
+/// mask of processes spawned from Python cells untouched
+u32 EventLoopAddSignal(EventLoop *this, i32 signo) {
+    i32 fds[2];
+    i32 status = pipe(fds);
+    assert(status == 0 && "failed to create a signal pipe");
+    for (u32 i = 0; i < 2; i += 1) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    EventSignalPipes[signo] = fds[1];
+
+    struct sigaction action = {.sa_handler = EventSignalHandler, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    sigaction(signo, &action, NULL);
+    return EventLoopAdd(this, fds[0]);
+}
+
+/// Drains a signal source, returns whether the signal fired since the last call
+bool EventLoopTakeSignal(EventLoop *this, u32 source) {
+    u8   buffer[64];
+    bool fired = false;
+    while (read(this->sources[source].fd, buffer, sizeof(buffer)) > 0)
+        fired = true;
+    return fired;
+}
+
+/// Blocks until a source is ready. A negative `timeout_ms` waits forever.
+/// Returns the number of ready sources, 0 on timeout
+i32 EventLoopWait(EventLoop *this, i32 timeout_ms) {
+    i32 ready;
+    do {
+        ready = poll(this->sources, this->len, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    assert(ready >= 0 && "failed to `poll` event sources");
+    return ready;
+}
+
+bool EventLoopIsReadable(EventLoop *this, u32 source) {
+    assert(source < this->len);
+    return this->sources[source].revents & POLLIN;
+}
+
+bool EventLoopIsHangUp(EventLoop *this, u32 source) {
+    assert(source < this->len);
+    return this->sources[source].revents & (POLLHUP | POLLERR | POLLNVAL);
+}
+
+/// Monotonic time, for deadlines that must not jump with the wall clock
+u64 EventLoopNowMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
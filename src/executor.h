@@ -0,0 +1,510 @@
+#pragma once
+
+// Python headers *must* be included before standard headers
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "core.h"
+
+/// A second Ctrl-C within the window escalates the interrupt
+#define EXECUTOR_ESCALATE_WINDOW_MS 1000
+
+/// `PyOS_InputHook` runs at most this often while the user types
+#define EXECUTOR_INPUT_HOOK_INTERVAL_MS 10
+
+/// How long the editor lets a running input hook notice a keystroke
+#define EXECUTOR_INPUT_HOOK_GRACE_MS 50
+
+/// Built-in module `sys.stdin` reads through
+#define EXECUTOR_MODULE "_dy"
+
+/// Runs once at startup, in a namespace of its own. `sys.stdin` reads through
+/// `_dy.read`, so the editor knows when a cell reads the terminal. GNU
+/// readline would read it behind the editor's back, `input()` goes through
+/// `ExecutorReadline` instead, and pdb and cmd do fine without it
+#define EXECUTOR_STDIN_SOURCE                                                                     \
+    "import io, sys, _dy\n"                                                                       \
+    "class Stdin(io.RawIOBase):\n"                                                                \
+    "    def readable(self): return True\n"                                                       \
+    "    def fileno(self): return 0\n"                                                            \
+    "    def isatty(self): return True\n"                                                         \
+    "    def readinto(self, buffer):\n"                                                           \
+    "        data = _dy.read(len(buffer))\n"                                                      \
+    "        buffer[:len(data)] = data\n"                                                         \
+    "        return len(data)\n"                                                                  \
+    "sys.stdin = io.TextIOWrapper(io.BufferedReader(Stdin()), sys.stdin.encoding,\n"              \
+    "                             sys.stdin.errors, line_buffering=True)\n"                       \
+    "sys.modules['readline'] = None\n"
+
+typedef enum ExecutorState {
+    /// Waiting for the next cell
+    ExecutorStateIdle = 0,
+
+    /// A cell was handed over and is not finished yet
+    ExecutorStateBusy,
+
+    /// The editor is gone, the interpreter should shut down
+    ExecutorStateExit,
+} ExecutorState;
+
+/// How a running cell reads the terminal
+typedef enum ExecutorRead {
+    ExecutorReadNone = 0,
+
+    /// `input()` and the like: the editor reads the line, after the prompt
+    ExecutorReadLine,
+
+    /// `sys.stdin` read directly: the editor lets go of the terminal meanwhile
+    ExecutorReadRaw,
+} ExecutorRead;
+
+/// Hands cells over from the editor thread to the interpreter.
+///
+/// Python keeps running on the main thread: that's the only thread
+/// where signal handlers run, `signal.signal` works and SIGINT breaks
+/// out of blocking calls. The editor lives on its own thread instead
+typedef struct Executor {
+    pthread_mutex_t lock;
+    pthread_cond_t  wakeup;
+    ExecutorState   state;
+
+    /// Nul-terminated source of the cell, owned by the editor and
+    /// left untouched until the cell is done
+    char *cell;
+
+    /// Becomes readable once a cell is done, polled by the editor
+    i32 done_pipe[2];
+
+    /// When the current cell was submitted
+    struct timespec started_at;
+
+    /// Bumped for every cell, so a late interrupt can't hit the next one
+    u64 generation;
+
+    /// Time of the last Ctrl-C since `started_at`, if any
+    bool interrupted;
+    u64  interrupted_at_ms;
+
+    /// Thread running Python, the target of interrupts
+    pthread_t     interpreter;
+    unsigned long interpreter_id;
+
+    /// `PyOS_InputHook` is being called, signaled once it returns
+    bool           in_input_hook;
+    pthread_cond_t input_hook_done;
+
+    /// What the cell waits to read, with `input()`'s prompt
+    ExecutorRead read;
+    const char  *prompt;
+
+    /// The editor got to the read, signaled once it did. `line` is what it
+    /// read, `PyMem_RawMalloc`ed, and NULL after Ctrl-C
+    bool           answered;
+    char          *line;
+    pthread_cond_t read_done;
+} Executor;
+
+/// The executor the reading hooks hand over to, they get no argument
+static Executor *ExecutorActive;
+
+/// What an escalated interrupt needs to find its cell
+typedef struct ExecutorInterruptRequest {
+    Executor *executor;
+    u64       generation;
+} ExecutorInterruptRequest;
+
+void  ExecutorInit(Executor *this);
+void  ExecutorSubmit(Executor *this, char *cell);
+void  ExecutorShutdown(Executor *this);
+char *ExecutorWaitCell(Executor *this);
+void  ExecutorFinish(Executor *this);
+bool  ExecutorTakeDone(Executor *this);
+u64   ExecutorElapsedMs(Executor *this);
+void  ExecutorInterrupt(Executor *this);
+void  ExecutorYieldInput(Executor *this);
+void  ExecutorRunInputHook(Executor *this);
+void  ExecutorWakeEditor(Executor *this);
+
+void      ExecutorRegisterModule(void);
+void      ExecutorInstallStdin(void);
+PyObject *ExecutorModuleInit(void);
+char     *ExecutorReadline(FILE *in, FILE *out, const char *prompt);
+PyObject *ExecutorReadStdin(PyObject *module, PyObject *size);
+bool      ExecutorAsk(Executor *this, ExecutorRead read, const char *prompt, char **line);
+void      ExecutorEndRead(Executor *this);
+
+ExecutorRead ExecutorPendingRead(Executor *this, const char **prompt);
+bool         ExecutorReadsStdin(Executor *this);
+void         ExecutorAnswer(Executor *this, char *line, u32 len);
+
+struct timespec ExecutorDeadline(u32 ms);
+void *ExecutorRaiseAsync(void *arg);
+
+/// Has to be called on the interpreter thread, with the GIL held
+void ExecutorInit(Executor *this) {
+    *this = (Executor){0};
+    this->interpreter = pthread_self();
+    this->interpreter_id = PyThread_get_thread_ident();
+    pthread_mutex_init(&this->lock, NULL);
+
+    // timed waits must not jump with the wall clock
+    pthread_condattr_t monotonic;
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_cond_init(&this->wakeup, &monotonic);
+    pthread_cond_init(&this->input_hook_done, &monotonic);
+    pthread_cond_init(&this->read_done, &monotonic);
+    pthread_condattr_destroy(&monotonic);
+
+    i32 status = pipe(this->done_pipe);
+    assert(status == 0 && "failed to create the executor's pipe");
+    for (u32 i = 0; i < 2; i += 1) {
+        fcntl(this->done_pipe[i], F_SETFL, fcntl(this->done_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(this->done_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    ExecutorActive = this;
+    PyOS_ReadlineFunctionPointer = ExecutorReadline;
+    ExecutorInstallStdin();
+}
+
+static PyMethodDef ExecutorMethods[] = {
+    {"read", ExecutorReadStdin, METH_O, "Reads up to `size` bytes of stdin, the editor aside"},
+    {0},
+};
+
+static PyModuleDef ExecutorModule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = EXECUTOR_MODULE,
+    .m_methods = ExecutorMethods,
+};
+
+/// Has to be called before Python is initialized
+void ExecutorRegisterModule(void) { PyImport_AppendInittab(EXECUTOR_MODULE, ExecutorModuleInit); }
+
+PyObject *ExecutorModuleInit(void) { return PyModule_Create(&ExecutorModule); }
+
+/// Puts `sys.stdin` on top of `_dy.read`, with the GIL held
+void ExecutorInstallStdin(void) {
+    PyObject *globals = PyDict_New();
+    PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+    PyObject *result = PyRun_String(EXECUTOR_STDIN_SOURCE, Py_file_input, globals, globals);
+    if (result == NULL) PyErr_Print();
+    Py_XDECREF(result);
+    Py_DECREF(globals);
+}
+
+/// Editor side: runs `cell` on the interpreter thread
+void ExecutorSubmit(Executor *this, char *cell) {
+    pthread_mutex_lock(&this->lock);
+    assert(this->state == ExecutorStateIdle && "one cell at a time");
+    this->cell = cell;
+    this->state = ExecutorStateBusy;
+    this->generation += 1;
+    this->interrupted = false;
+    clock_gettime(CLOCK_MONOTONIC, &this->started_at);
+    pthread_cond_signal(&this->wakeup);
+    pthread_mutex_unlock(&this->lock);
+}
+
+/// Editor side: lets `ExecutorWaitCell` return NULL
+void ExecutorShutdown(Executor *this) {
+    pthread_mutex_lock(&this->lock);
+    this->state = ExecutorStateExit;
+    pthread_cond_signal(&this->wakeup);
+    pthread_mutex_unlock(&this->lock);
+}
+
+/// Interpreter side: blocks until there is a cell to run, NULL means exit.
+///
+/// The GIL is released meanwhile, so threads started from a cell keep
+/// going while the user types. An installed `PyOS_InputHook` (tkinter,
+/// GUI toolkits) gets called every `EXECUTOR_INPUT_HOOK_INTERVAL_MS`
+char *ExecutorWaitCell(Executor *this) {
+    PyThreadState *thread = PyEval_SaveThread();
+
+    pthread_mutex_lock(&this->lock);
+    while (this->state == ExecutorStateIdle) {
+        if (!PyOS_InputHook) {
+            pthread_cond_wait(&this->wakeup, &this->lock);
+            continue;
+        }
+        ExecutorRunInputHook(this);
+        if (this->state != ExecutorStateIdle) break;
+
+        struct timespec deadline = ExecutorDeadline(EXECUTOR_INPUT_HOOK_INTERVAL_MS);
+        pthread_cond_timedwait(&this->wakeup, &this->lock, &deadline);
+    }
+    char *cell = this->state == ExecutorStateBusy ? this->cell : NULL;
+    pthread_mutex_unlock(&this->lock);
+
+    PyEval_RestoreThread(thread);
+    return cell;
+}
+
+/// Called with the lock held. Like `PyOS_Readline` does, the hook runs
+/// without the GIL and takes it itself when it needs it
+void ExecutorRunInputHook(Executor *this) {
+    this->in_input_hook = true;
+    pthread_mutex_unlock(&this->lock);
+
+    PyOS_InputHook();
+
+    pthread_mutex_lock(&this->lock);
+    this->in_input_hook = false;
+    pthread_cond_broadcast(&this->input_hook_done);
+}
+
+/// Editor side: called when stdin turns readable. Hooks usually run until
+/// there is a keystroke on stdin, so the editor holds off reading it for a
+/// moment and lets a running hook see the key and return
+void ExecutorYieldInput(Executor *this) {
+    pthread_mutex_lock(&this->lock);
+    struct timespec deadline = ExecutorDeadline(EXECUTOR_INPUT_HOOK_GRACE_MS);
+    while (this->in_input_hook) {
+        if (pthread_cond_timedwait(&this->input_hook_done, &this->lock, &deadline) != 0) break;
+    }
+    pthread_mutex_unlock(&this->lock);
+}
+
+/// `ms` from now on the monotonic clock, for timed waits
+struct timespec ExecutorDeadline(u32 ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+/// Interpreter side: the cell got executed, the editor may reuse it.
+/// Called with the GIL held
+void ExecutorFinish(Executor *this) {
+    pthread_mutex_lock(&this->lock);
+    if (this->state == ExecutorStateBusy) this->state = ExecutorStateIdle;
+    this->cell = NULL;
+    pthread_mutex_unlock(&this->lock);
+
+    // interrupts are only sent while the cell is busy, with the lock held:
+    // one that came in as the cell was finishing is pending by now, and
+    // must not leak into the next one
+    if (PyErr_CheckSignals() < 0) PyErr_Clear();
+    PyThreadState_SetAsyncExc(this->interpreter_id, NULL);
+
+    ExecutorWakeEditor(this);
+}
+
+/// The editor polls the pipe, for the end of the cell and its reads
+void ExecutorWakeEditor(Executor *this) {
+    u8 byte = 1;
+    (void)write(this->done_pipe[1], &byte, 1);
+}
+
+/// Editor side: drains the done pipe, returns whether the cell finished
+bool ExecutorTakeDone(Executor *this) {
+    u8 buffer[16];
+    while (read(this->done_pipe[0], buffer, sizeof(buffer)) > 0)
+        ;
+    pthread_mutex_lock(&this->lock);
+    bool done = this->state != ExecutorStateBusy;
+    pthread_mutex_unlock(&this->lock);
+    return done;
+}
+
+/// `PyOS_ReadlineFunctionPointer`: `input()` and the like get the line the
+/// editor reads, so nothing else reads the terminal. Called without the GIL,
+/// returns the line with its newline, empty at EOF and NULL after Ctrl-C
+char *ExecutorReadline(FILE *in, FILE *out, const char *prompt) {
+    char *line = NULL;
+    if (!ExecutorAsk(ExecutorActive, ExecutorReadLine, prompt, &line)) {
+        line = PyMem_RawCalloc(1, 1);
+    }
+    return line;
+}
+
+/// `_dy.read(size)`, what `sys.stdin` reads through. The editor lets go of
+/// the terminal for the read, which sees it as the tty driver does it:
+/// cooked, echoed, and Ctrl-C sends SIGINT
+PyObject *ExecutorReadStdin(PyObject *module, PyObject *size_arg) {
+    Py_ssize_t size = PyLong_AsSsize_t(size_arg);
+    if (size < 0) {
+        if (!PyErr_Occurred()) PyErr_SetString(PyExc_ValueError, "negative size");
+        return NULL;
+    }
+    PyObject *bytes = PyBytes_FromStringAndSize(NULL, size);
+    if (bytes == NULL) return NULL;
+
+    ssize_t num_read;
+    i32     error = 0;
+    while (true) {
+        Py_BEGIN_ALLOW_THREADS
+        num_read = 0;
+        if (ExecutorAsk(ExecutorActive, ExecutorReadRaw, NULL, NULL)) {
+            num_read = read(STDIN_FILENO, PyBytes_AS_STRING(bytes), size);
+            error = errno;
+            ExecutorEndRead(ExecutorActive);
+        }
+        Py_END_ALLOW_THREADS
+        if (num_read >= 0 || error != EINTR) break;
+        // Ctrl-C, the handler tripped the flag
+        if (PyErr_CheckSignals() < 0) {
+            Py_DECREF(bytes);
+            return NULL;
+        }
+    }
+    if (num_read < 0) {
+        Py_DECREF(bytes);
+        errno = error;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    _PyBytes_Resize(&bytes, num_read);
+    return bytes;
+}
+
+/// Interpreter side, without the GIL: hands a read over to the editor and
+/// waits till it gets to it. Only a running cell can read the terminal, the
+/// prompt belongs to the editor otherwise: a read from a thread the cell
+/// left behind gets EOF
+bool ExecutorAsk(Executor *this, ExecutorRead read, const char *prompt, char **line) {
+    pthread_mutex_lock(&this->lock);
+    if (this->state != ExecutorStateBusy) {
+        pthread_mutex_unlock(&this->lock);
+        return false;
+    }
+    this->read = read;
+    this->prompt = prompt;
+    this->answered = false;
+    this->line = NULL;
+    ExecutorWakeEditor(this);
+    while (!this->answered)
+        pthread_cond_wait(&this->read_done, &this->lock);
+    if (line) *line = this->line;
+    this->line = NULL;
+    // a direct read holds on to the terminal till `ExecutorEndRead`
+    if (read == ExecutorReadLine) this->read = ExecutorReadNone;
+    pthread_mutex_unlock(&this->lock);
+    return true;
+}
+
+/// Interpreter side: a direct read of stdin is over, the editor takes it back
+void ExecutorEndRead(Executor *this) {
+    pthread_mutex_lock(&this->lock);
+    this->read = ExecutorReadNone;
+    pthread_mutex_unlock(&this->lock);
+    ExecutorWakeEditor(this);
+}
+
+/// Editor side: the read the cell waits for, none once it's answered
+ExecutorRead ExecutorPendingRead(Executor *this, const char **prompt) {
+    pthread_mutex_lock(&this->lock);
+    ExecutorRead read = this->answered ? ExecutorReadNone : this->read;
+    *prompt = this->prompt;
+    pthread_mutex_unlock(&this->lock);
+    return read;
+}
+
+/// Editor side: whether the terminal is the cell's, for a direct read
+bool ExecutorReadsStdin(Executor *this) {
+    pthread_mutex_lock(&this->lock);
+    bool reads = this->read == ExecutorReadRaw;
+    pthread_mutex_unlock(&this->lock);
+    return reads;
+}
+
+/// Editor side: lets the cell's read go on. `line` is what `input()`
+/// returns, NULL raises `KeyboardInterrupt`. A direct read takes none
+void ExecutorAnswer(Executor *this, char *line, u32 len) {
+    pthread_mutex_lock(&this->lock);
+    if (this->read != ExecutorReadNone && !this->answered) {
+        if (line) {
+            this->line = PyMem_RawMalloc(len + 1);
+            memcpy(this->line, line, len);
+            this->line[len] = '\0';
+        }
+        this->answered = true;
+        pthread_cond_signal(&this->read_done);
+    }
+    pthread_mutex_unlock(&this->lock);
+}
+
+u64 ExecutorElapsedMs(Executor *this) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)(now.tv_sec - this->started_at.tv_sec) * 1000 +
+           (now.tv_nsec - this->started_at.tv_nsec) / 1000000;
+}
+
+/// Editor side: raises `KeyboardInterrupt` in the running cell.
+///
+/// The first Ctrl-C is a SIGINT sent to the interpreter thread: Python's
+/// handler trips the same flag as `PyErr_SetInterrupt`, and the signal
+/// also breaks blocking calls (`time.sleep`, socket reads) out with EINTR.
+/// A second one within `EXECUTOR_ESCALATE_WINDOW_MS` means the cell ignored
+/// it, so the exception is injected with `PyThreadState_SetAsyncExc`, past
+/// any SIGINT handler the cell installed
+void ExecutorInterrupt(Executor *this) {
+    pthread_mutex_lock(&this->lock);
+    if (this->state != ExecutorStateBusy) {
+        pthread_mutex_unlock(&this->lock);
+        return;
+    }
+    u64  now = ExecutorElapsedMs(this);
+    bool escalate =
+        this->interrupted && now - this->interrupted_at_ms <= EXECUTOR_ESCALATE_WINDOW_MS;
+    this->interrupted = true;
+    this->interrupted_at_ms = now;
+    u64 generation = this->generation;
+    // `input()` gives up its line and raises `KeyboardInterrupt`
+    if (this->read == ExecutorReadLine && !this->answered) {
+        this->answered = true;
+        pthread_cond_signal(&this->read_done);
+    }
+    // sent before the lock is let go, so the cell can't finish in between
+    // and leave the signal to the next one
+    if (!escalate) pthread_kill(this->interpreter, SIGINT);
+    pthread_mutex_unlock(&this->lock);
+    if (!escalate) return;
+
+    // taking the GIL may take a while if the cell sits in C code,
+    // the editor must not wait for it
+    // each helper gets its own request, a later escalation can't change its generation
+    ExecutorInterruptRequest *request = malloc(sizeof(ExecutorInterruptRequest));
+    if (request == NULL) return;
+    *request = (ExecutorInterruptRequest){.executor = this, .generation = generation};
+    pthread_t helper;
+    if (pthread_create(&helper, NULL, ExecutorRaiseAsync, request) == 0) {
+        pthread_detach(helper);
+    } else {
+        free(request);
+    }
+}
+
+/// Helper thread of an escalated interrupt, owns and frees `arg`
+void *ExecutorRaiseAsync(void *arg) {
+    ExecutorInterruptRequest request = *(ExecutorInterruptRequest *)arg;
+    Executor                *this = request.executor;
+    free(arg);
+
+    PyGILState_STATE gil = PyGILState_Ensure();
+    pthread_mutex_lock(&this->lock);
+    bool same_cell = this->state == ExecutorStateBusy && this->generation == request.generation;
+    pthread_mutex_unlock(&this->lock);
+    if (same_cell) {
+        PyThreadState_SetAsyncExc(this->interpreter_id, PyExc_KeyboardInterrupt);
+    }
+    PyGILState_Release(gil);
+    return NULL;
+}
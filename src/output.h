@@ -0,0 +1,82 @@
+#pragma once
+
+#include <assert.h>
+#include <errno.h>
+#include <memory.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "core.h"
+
+/// What an `Output` handed to the kernel so far
+typedef struct OutputStats {
+    u64 bytes;
+    u64 writes;
+} OutputStats;
+
+/// Collects the bytes of a frame and writes them out at once.
+///
+/// Nothing else lives in the arena and a frame never outgrows its first
+/// chunk, so consecutive allocations are contiguous and the pending bytes
+/// are simply `arena.ptr[0..allocated]`
+typedef struct Output {
+    i32         fd;
+    Arena       arena;
+    OutputStats stats;
+} Output;
+
+void OutputAppend(Output *this, char *bytes, u32 len);
+void OutputPuts(Output *this, char *s);
+void OutputPutc(Output *this, char c);
+void OutputPrintf(Output *this, char *format, ...) __attribute__((format(printf, 2, 3)));
+u32  OutputLen(Output *this);
+void OutputTruncate(Output *this, u32 len);
+void OutputFlush(Output *this);
+
+void OutputAppend(Output *this, char *bytes, u32 len) {
+    u8 *dst = ArenaAlloc(&this->arena, len);
+    memcpy(dst, bytes, len);
+}
+
+void OutputPuts(Output *this, char *s) { OutputAppend(this, s, strlen(s)); }
+
+void OutputPutc(Output *this, char c) { *(char *)ArenaAlloc(&this->arena, 1) = c; }
+
+/// Formats straight into the arena, no intermediate buffer
+void OutputPrintf(Output *this, char *format, ...) {
+    char *dst = ArenaAlloc(&this->arena, 0);
+    u64   available = this->arena.bound - this->arena.allocated;
+
+    va_list args;
+    va_start(args, format);
+    i32 len = vsnprintf(dst, available, format, args);
+    va_end(args);
+
+    assert(len >= 0 && (u64)len < available && "failed to format the output");
+    ArenaAlloc(&this->arena, len);
+}
+
+u32 OutputLen(Output *this) { return this->arena.allocated; }
+
+/// Drops the bytes appended after the first `len`
+void OutputTruncate(Output *this, u32 len) {
+    assert(len <= OutputLen(this));
+    this->arena.allocated = len;
+}
+
+/// Writes the pending bytes with as few syscalls as the kernel allows
+void OutputFlush(Output *this) {
+    u32 len = OutputLen(this);
+    u32 written = 0;
+    while (written < len) {
+        ssize_t status = write(this->fd, this->arena.ptr + written, len - written);
+        this->stats.writes += 1;
+        if (status < 0 && errno == EINTR) continue;
+        if (status <= 0) break; /* the terminal is gone, nothing to do about it */
+        written += status;
+    }
+    this->stats.bytes += written;
+    ArenaReset(&this->arena);
+}
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+
+#include "core.h"
+
+// SSE2 is always there on x86-64, AVX2 gets picked at runtime
+#if defined(__x86_64__)
+#define SCAN_SIMD
+#include <immintrin.h>
+#endif
+
+/// Byte scans behind the `String` helpers, which may run over megabytes
+/// of pasted input or history. Every scan comes in a scalar version, which
+/// is the reference the others have to agree with, and SSE2 and AVX2 ones
+/// on x86-64. Whitespace is ASCII's: ' ', '\t', '\n', '\v', '\f' and '\r'
+
+u32 ScanCount(char *buffer, u32 len, char needle);
+u32 ScanNth(char *buffer, u32 len, u32 n, char needle);
+u32 ScanLeading(char *buffer, u32 len, char c);
+u32 ScanFirstNotSpace(char *buffer, u32 len);
+u32 ScanTrimRight(char *buffer, u32 len);
+
+bool ScanIsSpace(char c);
+bool ScanHasAvx2(void);
+
+u32 ScanCountScalar(char *buffer, u32 len, char needle);
+u32 ScanNthScalar(char *buffer, u32 len, u32 n, char needle);
+u32 ScanLeadingScalar(char *buffer, u32 len, char c);
+u32 ScanFirstNotSpaceScalar(char *buffer, u32 len);
+u32 ScanTrimRightScalar(char *buffer, u32 len);
+
+#ifdef SCAN_SIMD
+u32 ScanCountSse2(char *buffer, u32 len, char needle);
+u32 ScanNthSse2(char *buffer, u32 len, u32 n, char needle);
+u32 ScanLeadingSse2(char *buffer, u32 len, char c);
+u32 ScanFirstNotSpaceSse2(char *buffer, u32 len);
+u32 ScanTrimRightSse2(char *buffer, u32 len);
+
+u32 ScanCountAvx2(char *buffer, u32 len, char needle);
+u32 ScanNthAvx2(char *buffer, u32 len, u32 n, char needle);
+u32 ScanLeadingAvx2(char *buffer, u32 len, char c);
+u32 ScanFirstNotSpaceAvx2(char *buffer, u32 len);
+u32 ScanTrimRightAvx2(char *buffer, u32 len);
+#endif
+
+/// How many times `needle` occurs
+u32 ScanCount(char *buffer, u32 len, char needle) {
+#ifdef SCAN_SIMD
+    if (ScanHasAvx2()) return ScanCountAvx2(buffer, len, needle);
+    return ScanCountSse2(buffer, len, needle);
+#else
+    return ScanCountScalar(buffer, len, needle);
+#endif
+}
+
+/// Index of the `n`th `needle`, counting from 1, `len` if there are fewer
+u32 ScanNth(char *buffer, u32 len, u32 n, char needle) {
+    assert(n > 0);
+#ifdef SCAN_SIMD
+    if (ScanHasAvx2()) return ScanNthAvx2(buffer, len, n, needle);
+    return ScanNthSse2(buffer, len, n, needle);
+#else
+    return ScanNthScalar(buffer, len, n, needle);
+#endif
+}
+
+/// How many chars at the start are `c`
+u32 ScanLeading(char *buffer, u32 len, char c) {
+#ifdef SCAN_SIMD
+    if (ScanHasAvx2()) return ScanLeadingAvx2(buffer, len, c);
+    return ScanLeadingSse2(buffer, len, c);
+#else
+    return ScanLeadingScalar(buffer, len, c);
+#endif
+}
+
+/// Index of the first char that isn't whitespace, `len` if there is none
+u32 ScanFirstNotSpace(char *buffer, u32 len) {
+#ifdef SCAN_SIMD
+    if (ScanHasAvx2()) return ScanFirstNotSpaceAvx2(buffer, len);
+    return ScanFirstNotSpaceSse2(buffer, len);
+#else
+    return ScanFirstNotSpaceScalar(buffer, len);
+#endif
+}
+
+/// Length without the trailing whitespace
+u32 ScanTrimRight(char *buffer, u32 len) {
+#ifdef SCAN_SIMD
+    if (ScanHasAvx2()) return ScanTrimRightAvx2(buffer, len);
+    return ScanTrimRightSse2(buffer, len);
+#else
+    return ScanTrimRightScalar(buffer, len);
+#endif
+}
+
+bool ScanIsSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+/// Only a load and a test: libgcc fills in the CPU's features before main
+bool ScanHasAvx2(void) {
+#ifdef SCAN_SIMD
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#else
+    return false;
+#endif
+}
+
+u32 ScanCountScalar(char *buffer, u32 len, char needle) {
+    u32 count = 0;
+    for (u32 i = 0; i < len; i += 1) {
+        if (buffer[i] == needle) count += 1;
+    }
+    return count;
+}
+
+u32 ScanNthScalar(char *buffer, u32 len, u32 n, char needle) {
+    for (u32 i = 0; i < len; i += 1) {
+        if (buffer[i] == needle && --n == 0) return i;
+    }
+    return len;
+}
+
+u32 ScanLeadingScalar(char *buffer, u32 len, char c) {
+    u32 i = 0;
+    while (i < len && buffer[i] == c)
+        i += 1;
+    return i;
+}
+
+u32 ScanFirstNotSpaceScalar(char *buffer, u32 len) {
+    u32 i = 0;
+    while (i < len && ScanIsSpace(buffer[i]))
+        i += 1;
+    return i;
+}
+
+u32 ScanTrimRightScalar(char *buffer, u32 len) {
+    while (len > 0 && ScanIsSpace(buffer[len - 1]))
+        len -= 1;
+    return len;
+}
+
+#ifdef SCAN_SIMD
+
+/// Whitespace is ' ' and what's in ['\t', '\r'], which ends up in [0, 4]
+/// once '\t' is subtracted. The constants are set up once per scan
+typedef struct ScanSpacesSse2 {
+    __m128i tab, four, space;
+} ScanSpacesSse2;
+
+/// Bit per byte of `chunk`, set for the whitespace ones. Inlined even in
+/// debug builds, a call per chunk would cost more than the scan
+__attribute__((always_inline)) static inline u32 ScanSpaceMaskSse2(ScanSpacesSse2 *spaces,
+                                                                   __m128i         chunk) {
+    __m128i shifted = _mm_sub_epi8(chunk, spaces->tab);
+    __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(shifted, spaces->four), shifted);
+    __m128i space = _mm_cmpeq_epi8(chunk, spaces->space);
+    return _mm_movemask_epi8(_mm_or_si128(control, space));
+}
+
+u32 ScanCountSse2(char *buffer, u32 len, char needle) {
+    __m128i needles = _mm_set1_epi8(needle);
+    u32     count = 0, i = 0;
+    while (len - i >= 16) {
+        // matches are -1, subtracting them counts per byte, which
+        // gets summed up before 255 chunks can overflow it
+        __m128i counts = _mm_setzero_si128();
+        u32     chunks = (len - i) / 16 < 255 ? (len - i) / 16 : 255;
+        for (u32 chunk = 0; chunk < chunks; chunk += 1, i += 16) {
+            __m128i bytes = _mm_loadu_si128((__m128i *)(buffer + i));
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(bytes, needles));
+        }
+        __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+    return count + ScanCountScalar(buffer + i, len - i, needle);
+}
+
+u32 ScanNthSse2(char *buffer, u32 len, u32 n, char needle) {
+    __m128i needles = _mm_set1_epi8(needle);
+    u32     i = 0;
+    for (; len - i >= 16; i += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *)(buffer + i));
+        u32     mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, needles));
+        u32     found = __builtin_popcount(mask);
+        if (found < n) {
+            n -= found;
+            continue;
+        }
+        while (--n)
+            mask &= mask - 1;
+        return i + __builtin_ctz(mask);
+    }
+    return i + ScanNthScalar(buffer + i, len - i, n, needle);
+}
+
+u32 ScanLeadingSse2(char *buffer, u32 len, char c) {
+    __m128i cs = _mm_set1_epi8(c);
+    u32     i = 0;
+    for (; len - i >= 16; i += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *)(buffer + i));
+        u32     other = ~_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, cs)) & 0xFFFF;
+        if (other) return i + __builtin_ctz(other);
+    }
+    return i + ScanLeadingScalar(buffer + i, len - i, c);
+}
+
+u32 ScanFirstNotSpaceSse2(char *buffer, u32 len) {
+    ScanSpacesSse2 spaces = {_mm_set1_epi8('\t'), _mm_set1_epi8(4), _mm_set1_epi8(' ')};
+    u32            i = 0;
+    for (; len - i >= 16; i += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *)(buffer + i));
+        u32     other = ~ScanSpaceMaskSse2(&spaces, bytes) & 0xFFFF;
+        if (other) return i + __builtin_ctz(other);
+    }
+    return i + ScanFirstNotSpaceScalar(buffer + i, len - i);
+}
+
+u32 ScanTrimRightSse2(char *buffer, u32 len) {
+    ScanSpacesSse2 spaces = {_mm_set1_epi8('\t'), _mm_set1_epi8(4), _mm_set1_epi8(' ')};
+    for (; len >= 16; len -= 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *)(buffer + len - 16));
+        u32     other = ~ScanSpaceMaskSse2(&spaces, bytes) & 0xFFFF;
+        if (other) return len - 16 + 32 - __builtin_clz(other);
+    }
+    return ScanTrimRightScalar(buffer, len);
+}
+
+// The AVX2 ones leave what's shorter than 32 bytes to the SSE2 ones
+
+typedef struct ScanSpacesAvx2 {
+    __m256i tab, four, space;
+} ScanSpacesAvx2;
+
+__attribute__((target("avx2,popcnt"), always_inline)) static inline u32
+ScanSpaceMaskAvx2(ScanSpacesAvx2 *spaces, __m256i chunk) {
+    __m256i shifted = _mm256_sub_epi8(chunk, spaces->tab);
+    __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, spaces->four), shifted);
+    __m256i space = _mm256_cmpeq_epi8(chunk, spaces->space);
+    return _mm256_movemask_epi8(_mm256_or_si256(control, space));
+}
+
+__attribute__((target("avx2,popcnt"))) u32 ScanCountAvx2(char *buffer, u32 len, char needle) {
+    __m256i needles = _mm256_set1_epi8(needle);
+    u32     count = 0, i = 0;
+    while (len - i >= 32) {
+        __m256i counts = _mm256_setzero_si256();
+        u32     chunks = (len - i) / 32 < 255 ? (len - i) / 32 : 255;
+        for (u32 chunk = 0; chunk < chunks; chunk += 1, i += 32) {
+            __m256i bytes = _mm256_loadu_si256((__m256i *)(buffer + i));
+            counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(bytes, needles));
+        }
+        __m256i sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+        __m128i half =
+            _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        count += _mm_cvtsi128_si32(half) + _mm_extract_epi16(half, 4);
+    }
+    return count + ScanCountSse2(buffer + i, len - i, needle);
+}
+
+__attribute__((target("avx2,popcnt"))) u32 ScanNthAvx2(char *buffer, u32 len, u32 n, char needle) {
+    __m256i needles = _mm256_set1_epi8(needle);
+    u32     i = 0;
+    for (; len - i >= 32; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((__m256i *)(buffer + i));
+        u32     mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, needles));
+        u32     found = __builtin_popcount(mask);
+        if (found < n) {
+            n -= found;
+            continue;
+        }
+        while (--n)
+            mask &= mask - 1;
+        return i + __builtin_ctz(mask);
+    }
+    return i + ScanNthSse2(buffer + i, len - i, n, needle);
+}
+
+__attribute__((target("avx2,popcnt"))) u32 ScanLeadingAvx2(char *buffer, u32 len, char c) {
+    __m256i cs = _mm256_set1_epi8(c);
+    u32     i = 0;
+    for (; len - i >= 32; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((__m256i *)(buffer + i));
+        u32     other = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, cs));
+        if (other) return i + __builtin_ctz(other);
+    }
+    return i + ScanLeadingSse2(buffer + i, len - i, c);
+}
+
+__attribute__((target("avx2,popcnt"))) u32 ScanFirstNotSpaceAvx2(char *buffer, u32 len) {
+    ScanSpacesAvx2 spaces = {_mm256_set1_epi8('\t'), _mm256_set1_epi8(4), _mm256_set1_epi8(' ')};
+    u32            i = 0;
+    for (; len - i >= 32; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((__m256i *)(buffer + i));
+        u32     other = ~ScanSpaceMaskAvx2(&spaces, bytes);
+        if (other) return i + __builtin_ctz(other);
+    }
+    return i + ScanFirstNotSpaceSse2(buffer + i, len - i);
+}
+
+__attribute__((target("avx2,popcnt"))) u32 ScanTrimRightAvx2(char *buffer, u32 len) {
+    ScanSpacesAvx2 spaces = {_mm256_set1_epi8('\t'), _mm256_set1_epi8(4), _mm256_set1_epi8(' ')};
+    for (; len >= 32; len -= 32) {
+        __m256i bytes = _mm256_loadu_si256((__m256i *)(buffer + len - 32));
+        u32     other = ~ScanSpaceMaskAvx2(&spaces, bytes);
+        if (other) return len - __builtin_clz(other);
+    }
+    return ScanTrimRightSse2(buffer, len);
+}
+
+#endif
@@ -0,0 +1,372 @@
+#pragma once
+
+#include <assert.h>
+#include <memory.h>
+
+#include "arena.h"
+#include "array.h"
+#include "core.h"
+#include "output.h"
+#include "style.h"
+
+/// Erase the rest of the line/screen, insert/delete lines
+#define SCREEN_ERASE_LINE    "\x1b[K"
+#define SCREEN_ERASE_BELOW   "\x1b[J"
+#define SCREEN_INSERT_LINES  "\x1b[%uL"
+#define SCREEN_DELETE_LINES  "\x1b[%uM"
+#define SCREEN_CURSOR_UP     "\x1b[%uA"
+#define SCREEN_CURSOR_DOWN   "\x1b[%uB"
+#define SCREEN_CURSOR_COLUMN "\x1b[%uG"
+
+/// Runs of unchanged cells shorter than this get reprinted
+/// rather than jumped over, a cursor move costs about as much
+#define SCREEN_MIN_SKIP 5
+
+/// Bytes a cell holds, enough for a grapheme with a few marks or a flag
+#define SCREEN_CELL_BYTES 11
+
+/// Index into the screen's theme, 0 is the terminal's default look
+typedef u8 ScreenStyle;
+
+/// A grapheme as printed, nul-padded. The cell after a wide one is all zeros:
+/// the terminal fills it, nothing gets printed there
+typedef struct ScreenCell {
+    char        ch[SCREEN_CELL_BYTES];
+    ScreenStyle style;
+} ScreenCell;
+
+typedef struct ScreenRow {
+    ScreenCell *cells;
+    u32         len;
+} ScreenRow;
+
+typedef struct ScreenRows {
+    ArrayHeader header;
+    ScreenRow  *buffer;
+} ScreenRows;
+
+/// Where the terminal's cursor is and which SGR is in effect
+typedef struct ScreenCursor {
+    u32         row, col;
+    ScreenStyle style;
+} ScreenCursor;
+
+/// Model of the rows the editor painted, row 0 being the prompt line.
+///
+/// A frame is built from scratch in the spare arena, copying the rows
+/// that did not change, and diffed against the previous one: only the
+/// changed cells are written, and rows shifted by inserted or deleted
+/// lines are moved by the terminal instead of being repainted
+typedef struct Screen {
+    /// Rows the terminal shows, and the frame being built
+    ScreenRows rows;
+    ScreenRows next;
+
+    /// `rows` lives in `arenas[current]`, `next` in the other one
+    Arena arenas[2];
+    u32   current;
+
+    ScreenCursor cursor;
+
+    /// The terminal content is unknown (say, after a resize),
+    /// the next frame repaints every row
+    bool stale;
+
+    /// Looks of the `ScreenStyle`s, and how to switch between them
+    StyleTheme *theme;
+} Screen;
+
+void        ScreenReset(Screen *this);
+void        ScreenBeginFrame(Screen *this);
+ScreenCell *ScreenPushRow(Screen *this, u32 len);
+void        ScreenKeepRow(Screen *this, u32 index);
+bool        ScreenHasRow(Screen *this, i64 index);
+void        ScreenEndFrame(Screen *this, Output *out, u32 height);
+void        ScreenMoveTo(Screen *this, Output *out, u32 row, u32 col);
+void        ScreenSetStyle(Screen *this, Output *out, ScreenStyle style);
+
+bool ScreenScroll(Screen *this, Output *out, i64 delta, u32 height);
+void ScreenShiftRows(Screen *this, Output *out, u32 height);
+void ScreenUpdateRow(Screen *this, Output *out, u32 index);
+void ScreenPaintRow(Screen *this, Output *out, u32 index, ScreenRow *old, ScreenRow *new);
+void ScreenPaintChanges(Screen *this, Output *out, u32 index, ScreenRow *old, ScreenRow *new);
+void ScreenPaintCells(Screen *this, Output *out, ScreenRow *row, u32 from, u32 to);
+bool ScreenRowEqual(ScreenRow *a, ScreenRow *b);
+bool ScreenCellEqual(ScreenCell a, ScreenCell b);
+
+/// Forgets the rows, the cursor is at the start of a fresh prompt line
+void ScreenReset(Screen *this) {
+    ArenaReset(&this->arenas[0]);
+    ArenaReset(&this->arenas[1]);
+    this->rows = (ScreenRows){0};
+    this->next = (ScreenRows){0};
+    this->current = 0;
+    this->cursor.row = 0;
+    this->cursor.col = 0;
+}
+
+void ScreenBeginFrame(Screen *this) {
+    ArenaReset(&this->arenas[!this->current]);
+    this->next = (ScreenRows){0};
+}
+
+/// Appends a row of `len` cells to the next frame, for the caller to fill
+ScreenCell *ScreenPushRow(Screen *this, u32 len) {
+    Arena      *arena = &this->arenas[!this->current];
+    ScreenCell *cells = ArenaAllocAligned(arena, len * sizeof(ScreenCell), _Alignof(ScreenCell));
+    ScreenRow   row = {.cells = cells, .len = len};
+    ArrayPush(&this->next, arena, row);
+    return row.cells;
+}
+
+/// Appends the `index`-th row of the current frame to the next one as is
+void ScreenKeepRow(Screen *this, u32 index) {
+    ScreenRow   row = ArrayGetNth(&this->rows, index);
+    ScreenCell *cells = ScreenPushRow(this, row.len);
+    memcpy(cells, row.cells, row.len * sizeof(ScreenCell));
+}
+
+/// Whether the `index`-th row of the current frame has known content,
+/// rows scrolled in by `ScreenScroll` don't
+bool ScreenHasRow(Screen *this, i64 index) {
+    return index >= 0 && index < ArrayLen(&this->rows) && this->rows.buffer[index].cells;
+}
+
+/// Brings the terminal from the current frame to the next one, which
+/// becomes current. `height` bounds what lines can be moved on screen
+void ScreenEndFrame(Screen *this, Output *out, u32 height) {
+    if (!this->stale) ScreenShiftRows(this, out, height);
+
+    u32 new_len = ArrayLen(&this->next);
+    for (u32 i = 0; i < new_len; i += 1)
+        ScreenUpdateRow(this, out, i);
+
+    // what's left of the old frame below the new one
+    if (ArrayLen(&this->rows) > new_len) {
+        ScreenMoveTo(this, out, new_len, 0);
+        OutputPuts(out, SCREEN_ERASE_BELOW);
+    }
+    ScreenSetStyle(this, out, 0);
+
+    this->rows = this->next;
+    this->next = (ScreenRows){0};
+    this->current = !this->current;
+    this->stale = false;
+}
+
+/// The viewport moved `delta` rows down (up if negative): if the rows fill
+/// the screen, they are moved by the terminal instead of being repainted,
+/// rows scrolled in are blank. Returns whether the rows moved, `rows` gets
+/// updated to mirror the terminal
+bool ScreenScroll(Screen *this, Output *out, i64 delta, u32 height) {
+    u32 len = ArrayLen(&this->rows);
+    u32 count = delta < 0 ? -delta : delta;
+    if (this->stale || count == 0 || len != height || count >= len) return false;
+
+    if (delta > 0) {
+        // newlines at the bottom push the top rows into the scrollback
+        ScreenMoveTo(this, out, len - 1, 0);
+        for (u32 i = 0; i < count; i += 1)
+            OutputPutc(out, '\n');
+        memmove(&this->rows.buffer[0], &this->rows.buffer[count],
+                (len - count) * sizeof(ScreenRow));
+        this->rows.header.len = len - count;
+    } else {
+        // the first row is the top of the screen
+        ScreenMoveTo(this, out, 0, 0);
+        OutputPrintf(out, SCREEN_INSERT_LINES, count);
+        memmove(&this->rows.buffer[count], &this->rows.buffer[0],
+                (len - count) * sizeof(ScreenRow));
+        for (u32 i = 0; i < count; i += 1)
+            this->rows.buffer[i] = (ScreenRow){0};
+    }
+    return true;
+}
+
+/// When lines got inserted or deleted in the middle, moves the unchanged
+/// rows below them with IL/DL, so they don't have to be repainted.
+/// `rows` gets updated to mirror the terminal
+void ScreenShiftRows(Screen *this, Output *out, u32 height) {
+    u32 old_len = ArrayLen(&this->rows);
+    u32 new_len = ArrayLen(&this->next);
+    if (old_len == new_len || new_len > height || old_len > height) return;
+
+    u32 shortest = old_len < new_len ? old_len : new_len;
+    u32 prefix = 0;
+    while (prefix < shortest &&
+           ScreenRowEqual(&this->rows.buffer[prefix], &this->next.buffer[prefix]))
+        prefix += 1;
+    u32 suffix = 0;
+    while (suffix < shortest - prefix &&
+           ScreenRowEqual(&this->rows.buffer[old_len - 1 - suffix],
+                          &this->next.buffer[new_len - 1 - suffix]))
+        suffix += 1;
+    if (suffix == 0) return;
+
+    Arena *arena = &this->arenas[this->current];
+    if (new_len > old_len) {
+        u32 count = new_len - old_len;
+        u32 at = old_len - suffix;
+
+        // grow the frame at the bottom first, so nothing gets pushed off the screen
+        ScreenMoveTo(this, out, old_len - 1 + count, 0);
+        ScreenMoveTo(this, out, at, 0);
+        OutputPrintf(out, SCREEN_INSERT_LINES, count);
+
+        ArrayEnsureAdditionalCap(&this->rows, arena, count);
+        memmove(&this->rows.buffer[at + count], &this->rows.buffer[at],
+                suffix * sizeof(ScreenRow));
+        for (u32 i = at; i < at + count; i += 1)
+            this->rows.buffer[i] = (ScreenRow){0};
+        this->rows.header.len = new_len;
+    } else {
+        u32 count = old_len - new_len;
+        u32 at = new_len - suffix;
+
+        // rows coming in at the bottom of the screen are blank, we erased them
+        ScreenMoveTo(this, out, at, 0);
+        OutputPrintf(out, SCREEN_DELETE_LINES, count);
+
+        memmove(&this->rows.buffer[at], &this->rows.buffer[at + count],
+                suffix * sizeof(ScreenRow));
+        this->rows.header.len = new_len;
+    }
+}
+
+/// Paints the `index`-th row of the next frame, picking whichever is
+/// shorter: the changed spans only, or the whole row
+void ScreenUpdateRow(Screen *this, Output *out, u32 index) {
+    ScreenRow *new = &this->next.buffer[index];
+    ScreenRow  none = {0};
+    ScreenRow *old = index < ArrayLen(&this->rows) ? &this->rows.buffer[index] : &none;
+    if (!this->stale && ScreenRowEqual(old, new)) return;
+
+    if (this->stale || index >= ArrayLen(&this->rows)) {
+        ScreenPaintRow(this, out, index, old, new);
+        return;
+    }
+
+    // render both into the output, keep the cheaper one
+    u32          mark = OutputLen(out);
+    ScreenCursor before = this->cursor;
+    ScreenPaintRow(this, out, index, old, new);
+    u32          whole_len = OutputLen(out) - mark;
+    ScreenCursor whole_cursor = this->cursor;
+
+    this->cursor = before;
+    ScreenPaintChanges(this, out, index, old, new);
+    u32 changes_len = OutputLen(out) - mark - whole_len;
+
+    if (changes_len < whole_len) {
+        u8 *bytes = out->arena.ptr + mark;
+        memmove(bytes, bytes + whole_len, changes_len);
+        OutputTruncate(out, mark + changes_len);
+    } else {
+        OutputTruncate(out, mark + whole_len);
+        this->cursor = whole_cursor;
+    }
+}
+
+/// Repaints the row from its first column
+void ScreenPaintRow(Screen *this, Output *out, u32 index, ScreenRow *old, ScreenRow *new) {
+    ScreenMoveTo(this, out, index, 0);
+    ScreenPaintCells(this, out, new, 0, new->len);
+    // rows new to the frame might have leftovers from before the prompt
+    if (this->stale || old->cells == NULL || old->len > new->len) {
+        ScreenSetStyle(this, out, 0);
+        OutputPuts(out, SCREEN_ERASE_LINE);
+    }
+}
+
+/// Writes only the cells that differ, jumping over long unchanged runs
+void ScreenPaintChanges(Screen *this, Output *out, u32 index, ScreenRow *old, ScreenRow *new) {
+    u32 col = 0;
+    while (col < new->len) {
+        if (col < old->len && ScreenCellEqual(old->cells[col], new->cells[col])) {
+            col += 1;
+            continue;
+        }
+
+        // extend the span until enough unchanged cells follow
+        u32 end = col + 1, same = 0;
+        while (end < new->len && same < SCREEN_MIN_SKIP) {
+            bool equal = end < old->len && ScreenCellEqual(old->cells[end], new->cells[end]);
+            same = equal ? same + 1 : 0;
+            end += 1;
+        }
+        end -= same;
+        // wide graphemes get painted whole
+        if (new->cells[col].ch[0] == 0 && col > 0) col -= 1;
+        while (end < new->len && new->cells[end].ch[0] == 0)
+            end += 1;
+
+        ScreenMoveTo(this, out, index, col);
+        ScreenPaintCells(this, out, new, col, end);
+        col = end;
+    }
+    if (old->len > new->len) {
+        ScreenMoveTo(this, out, index, new->len);
+        ScreenSetStyle(this, out, 0);
+        OutputPuts(out, SCREEN_ERASE_LINE);
+    }
+}
+
+void ScreenPaintCells(Screen *this, Output *out, ScreenRow *row, u32 from, u32 to) {
+    for (u32 col = from; col < to; col += 1) {
+        ScreenCell *cell = &row->cells[col];
+        if (cell->ch[0] == 0) continue;
+        // spaces between tokens would flip the style back and forth for nothing
+        bool blank = cell->ch[0] == ' ' && cell->ch[1] == 0;
+        bool keep = blank && this->theme->same_blank[this->cursor.style][cell->style];
+        if (!keep) ScreenSetStyle(this, out, cell->style);
+        if (cell->ch[1] == 0) {
+            OutputPutc(out, cell->ch[0]);
+        } else {
+            OutputAppend(out, cell->ch, strnlen(cell->ch, SCREEN_CELL_BYTES));
+        }
+    }
+    this->cursor.col += to - from;
+}
+
+/// Moves the cursor with the shortest sequence we know of. Going down
+/// past the last row scrolls the screen, that's how the frame grows
+void ScreenMoveTo(Screen *this, Output *out, u32 row, u32 col) {
+    if (row < this->cursor.row) {
+        OutputPrintf(out, SCREEN_CURSOR_UP, this->cursor.row - row);
+    } else if (row > this->cursor.row) {
+        // rows of the frame are there already, no need to scroll to them
+        u32 last = ArrayLen(&this->rows) ? ArrayLen(&this->rows) - 1 : 0;
+        u32 jump = row < last ? row : last;
+        if (jump > this->cursor.row + 3) {
+            OutputPrintf(out, SCREEN_CURSOR_DOWN, jump - this->cursor.row);
+            this->cursor.row = jump;
+        }
+        if (row > this->cursor.row) this->cursor.col = 0;
+        for (u32 i = this->cursor.row; i < row; i += 1)
+            OutputPutc(out, '\n');
+    }
+    this->cursor.row = row;
+
+    if (col == this->cursor.col) return;
+    if (col == 0) {
+        OutputPutc(out, '\r');
+    } else {
+        OutputPrintf(out, SCREEN_CURSOR_COLUMN, col + 1);
+    }
+    this->cursor.col = col;
+}
+
+void ScreenSetStyle(Screen *this, Output *out, ScreenStyle style) {
+    if (style == this->cursor.style) return;
+    OutputPuts(out, this->theme->transitions[this->cursor.style][style]);
+    this->cursor.style = style;
+}
+
+bool ScreenRowEqual(ScreenRow *a, ScreenRow *b) {
+    if (a->len != b->len) return false;
+    return a->len == 0 || memcmp(a->cells, b->cells, a->len * sizeof(ScreenCell)) == 0;
+}
+
+bool ScreenCellEqual(ScreenCell a, ScreenCell b) {
+    return memcmp(&a, &b, sizeof(ScreenCell)) == 0;
+}
@@ -1,13 +1,13 @@
 #pragma once
 
 #include <assert.h>
-#include <ctype.h>
 #include <memory.h>
 #include <stdbool.h>
 #include <sys/mman.h>
 
 #include "arena.h"
 #include "core.h"
+#include "scan.h"
 
 #define INDENTATION1 "    "
 #define INDENTATION2 "        "
@@ -62,6 +62,7 @@ bool StringIsPyTerminated(String *string);
 bool CharIsSpace(char c);
 bool CharIsDigit(char c);
 bool CharIsAlnum(char c);
+bool CharIsIdent(char c);
 bool CharIsDigit(char c);
 bool CharIsPunct(char c);
 bool CharIsQuote(char c);
@@ -72,6 +73,7 @@ String StringCopy(String *this, Arena *arena);
 
 String GenerateIndentation(u32 indentation, Arena *arena);
 u32    StringIndentationLevel(String *this);
+String StringIndentLines(String *this, Arena *arena, String *before);
 void   StringInsertIndentation(String *this, Arena *arena, u32 index, u32 indentation);
 String StringRightTrim(String *this);
 
@@ -101,7 +103,7 @@ void StringAppendRaw(String *this, Arena *arena, char *other) {
 void StringInsert(String *this, Arena *arena, u32 index, String *other) {
     if (other->len == 0) return;
     StringEnsureAdditional(this, arena, other->len);
-    if (index == this->len - 1) {
+    if (index == this->len) {
         StringAppend(this, arena, other);
         return;
     }
@@ -113,6 +115,7 @@ void StringInsert(String *this, Arena *arena, u32 index, String *other) {
 
 void StringInsertChar(String *this, Arena *arena, u32 index, char c) {
     assert(index <= this->len);
+    StringEnsureAdditional(this, arena, 1);
     if (index == this->len) {
         StringAppendChar(this, arena, c);
         return;
@@ -126,7 +129,7 @@ void StringInsertChar(String *this, Arena *arena, u32 index, char c) {
 void StringInsertRaw(String *this, Arena *arena, u32 index, char *raw) {
     u32 raw_len = strlen(raw);
     StringEnsureAdditional(this, arena, raw_len);
-    if (index == this->len - 1) {
+    if (index == this->len) {
         StringAppendRaw(this, arena, raw);
         return;
     }
@@ -138,7 +141,7 @@ void StringInsertRaw(String *this, Arena *arena, u32 index, char *raw) {
 
 void StringNulTerminate(String *this, Arena *arena) {
     StringEnsureAdditional(this, arena, 1);
-    assert(this->cap - this->len > 1);
+    assert(this->cap - this->len >= 1);
     this->buffer[this->len] = '\0';
 }
 
@@ -189,17 +192,10 @@ void StringEnsureAdditional(String *this, Arena *arena, u32 additional) {
     u32 remaining = this->cap - this->len;
     if (remaining >= additional) return;
 
-    u32   additional_cap = this->cap != 0 ? this->cap : 64;
+    u32 additional_cap = this->cap != 0 ? this->cap : 64;
+    if (additional_cap < additional) additional_cap = additional;
     u32   new_cap = this->cap + additional_cap;
-    char *new_buffer = ArenaAlloc(arena, new_cap);
-
-    if (this->len != 0 && this->buffer) {
-        memcpy(new_buffer, this->buffer, this->len);
-    }
-
-    StringMemZero(this);
-
-    this->buffer = new_buffer;
+    this->buffer = ArenaRealloc(arena, this->buffer, this->cap, new_cap);
     this->cap = new_cap;
 }
 
@@ -225,22 +221,17 @@ String StringSliceFromTo(String *this, u32 from, u32 to) {
     return (String){.buffer = this->buffer + from, .len = to - from, .cap = to - from};
 }
 
+/// Index of the `n`th `needle`, the length if there are fewer
 u32 StringSearchNth(String *this, u32 n, char needle) {
-    u32 idx;
-    for (idx = 0; idx < this->len && n != 0; idx += 1) {
-        if (this->buffer[idx] == needle) n -= 1;
-        if (n == 0) break;
-    }
-    return idx;
+    if (n == 0) return 0;
+    return ScanNth(this->buffer, this->len, n, needle);
 }
 
+/// Index right after the `n`th `needle`, the length if there are fewer
 u32 StringSearchNthAddOne(String *this, u32 n, char needle) {
-    u32 idx = 0;
-    for (idx = 0; idx < this->len && n != 0; idx += 1) {
-        if (this->buffer[idx] == needle) n -= 1;
-        if (n == 0) return idx + 1;
-    }
-    return idx;
+    if (n == 0) return 0;
+    u32 idx = ScanNth(this->buffer, this->len, n, needle);
+    return idx < this->len ? idx + 1 : idx;
 }
 
 String StringNthLine(String *multiline, u32 n) {
@@ -249,13 +240,7 @@ String StringNthLine(String *multiline, u32 n) {
     return StringSliceFromTo(multiline, start, end);
 }
 
-u32 StringCount(String *this, char needle) {
-    u32 count = 0;
-    for (u32 i = 0; i < this->len; i += 1) {
-        if (this->buffer[i] == needle) count += 1;
-    }
-    return count;
-}
+u32 StringCount(String *this, char needle) { return ScanCount(this->buffer, this->len, needle); }
 
 /// Returns the line count, not including
 /// empty lines
@@ -271,14 +256,7 @@ u32 StringLineCount(String *multiline) {
     return num_lines;
 }
 
-bool StringIsSpace(String *this) {
-    for (u32 i = 0; i < this->len; i += 1) {
-        if (!isspace(this->buffer[i])) {
-            return false;
-        }
-    }
-    return true;
-}
+bool StringIsSpace(String *this) { return ScanFirstNotSpace(this->buffer, this->len) == this->len; }
 
 bool StringEndsWith(String *string, char end) {
     if (string->len == 0) return false;
@@ -298,6 +276,10 @@ bool CharIsAlnum(char c) {
     return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
 }
 
+/// Identifiers are alphanumeric with underscores. Any byte past ASCII is
+/// taken as part of one too, Python allows most of them in names
+bool CharIsIdent(char c) { return CharIsAlnum(c) || c == '_' || (u8)c >= 0x80; }
+
 bool CharIsPunct(char c) {
     char punctuations[] = {
         ',',
@@ -340,12 +322,54 @@ String GenerateIndentation(u32 indentation, Arena *arena) {
     return (String){.buffer = buffer, .len = len, .cap = len};
 }
 
-u32 StringIndentationLevel(String *this) {
-    u32 idx;
-    for (idx = 0; idx < this->len; idx += 1) {
-        if (StringGetChar(this, idx) != ' ') break;
+u32 StringIndentationLevel(String *this) { return ScanLeading(this->buffer, this->len, ' ') / 4; }
+
+/// Copy of the multiline `this` with the lines after the first keeping their
+/// indentation relative to the first line, which sits where `before` puts it.
+/// A line right after a ':' that isn't indented past it goes a level deeper
+/// than that line, the way a newline typed there would. `before` is the text
+/// the first line goes after, it starts a line. Takes a single pass over `this`
+String StringIndentLines(String *this, Arena *arena, String *before) {
+    u32 line_end = StringSearchNth(this, 1, '\n');
+    if (line_end == this->len) return *this;
+
+    String out = {0};
+    StringEnsureAdditional(&out, arena, this->len);
+    memcpy(out.buffer, this->buffer, line_end);
+    out.len = line_end;
+
+    // the first line is `before` followed by the text up to the newline
+    u32  own = ScanLeading(this->buffer, line_end, ' ');
+    u32  spaces = ScanLeading(before->buffer, before->len, ' ');
+    if (spaces == before->len) spaces += own;
+    char last = line_end ? this->buffer[line_end - 1] : before->len ? StringPeek(before) : 0;
+    // column of the snippet's column 0, can be left of the screen's
+    i64  shift = (i64)spaces - own;
+    i64  above = spaces;
+
+    for (u32 at = line_end; at < this->len;) {
+        at += 1;
+        u32   start = at + ScanLeading(this->buffer + at, this->len - at, ' ');
+        char *newline = memchr(this->buffer + start, '\n', this->len - start);
+        line_end = newline ? newline - this->buffer : this->len;
+
+        i64 column = shift + (start - at);
+        if (last == ':' && start - at <= own) column = above + 4;
+        if (column < 0) column = 0;
+
+        StringEnsureAdditional(&out, arena, 1 + column + line_end - start);
+        out.buffer[out.len++] = '\n';
+        memset(out.buffer + out.len, ' ', column);
+        out.len += column;
+        memcpy(out.buffer + out.len, this->buffer + start, line_end - start);
+        out.len += line_end - start;
+
+        own = start - at;
+        above = column;
+        last = line_end != start ? this->buffer[line_end - 1] : 0;
+        at = line_end;
     }
-    return idx / 4;
+    return out;
 }
 
 void StringInsertIndentation(String *this, Arena *arena, u32 index, u32 indentation) {
@@ -374,9 +398,6 @@ void StringInsertIndentation(String *this, Arena *arena, u32 index, u32 indentat
 String StringRightTrim(String *this) {
     if (StringIsEmpty(this)) return (String){0};
 
-    u32 trimmed = this->len;
-    while (trimmed > 0 && isspace(this->buffer[trimmed - 1]))
-        trimmed -= 1;
-
+    u32 trimmed = ScanTrimRight(this->buffer, this->len);
     return (String){.len = trimmed, .cap = trimmed, .buffer = this->buffer};
 }
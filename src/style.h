@@ -0,0 +1,214 @@
+#pragma once
+
+#include <assert.h>
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "core.h"
+
+/// Styles a theme can hold, style 0 is the terminal's default look
+#define STYLE_MAX 16
+
+/// Longest SGR sequence a transition takes, with room to spare
+#define STYLE_MAX_SGR 32
+
+typedef enum StyleAttribute {
+    StyleBold = 1 << 0,
+    StyleDim = 1 << 1,
+    StyleItalic = 1 << 2,
+    StyleUnderline = 1 << 3,
+    StyleReverse = 1 << 4,
+} StyleAttribute;
+
+/// Look of a cell the way SGR sees it. Colors are the SGR codes
+/// themselves (31, 94, 42...), 0 is the terminal's default color
+typedef struct Style {
+    u8 fg, bg;
+    u8 attributes;
+} Style;
+
+/// A set of styles, plus the escape sequence that goes from any of
+/// them to any other. Baked once at startup: switching styles while
+/// painting is a table lookup, and only the attributes that actually
+/// differ are sent
+typedef struct StyleTheme {
+    Style styles[STYLE_MAX];
+    u32   len;
+
+    /// `transitions[from][to]`, nul-terminated, empty for `from == to`
+    char *transitions[STYLE_MAX][STYLE_MAX];
+
+    /// A space looks the same in both styles: no background, underline or
+    /// reverse in either. Lets the screen skip switching for blanks
+    bool same_blank[STYLE_MAX][STYLE_MAX];
+    Arena arena;
+} StyleTheme;
+
+bool StyleParse(char *sgr, u32 len, Style *style);
+bool StyleEqual(Style a, Style b);
+bool StyleHasBlankInk(Style style);
+u32  StyleTransition(Style from, Style to, char *buffer);
+u32  StyleFormat(u8 *codes, u32 count, char *buffer);
+
+bool StyleThemeApply(StyleTheme *this, char *spec, char **names, u32 name_count);
+void StyleThemeBake(StyleTheme *this);
+
+/// Applies SGR parameters, as in "1;33", on top of `style`.
+/// Only the codes a `Style` can hold are known, returns false on others
+bool StyleParse(char *sgr, u32 len, Style *style) {
+    u32 i = 0;
+    while (i < len) {
+        u32 code = 0, digits = 0;
+        for (; i < len && sgr[i] >= '0' && sgr[i] <= '9'; i += 1, digits += 1)
+            code = code * 10 + (sgr[i] - '0');
+        if (i < len && sgr[i] != ';') return false;
+        i += 1;
+        if (digits == 0 || digits > 3) return false;
+
+        if (code == 0) {
+            *style = (Style){0};
+        } else if (code == 1) {
+            style->attributes |= StyleBold;
+        } else if (code == 2) {
+            style->attributes |= StyleDim;
+        } else if (code == 3) {
+            style->attributes |= StyleItalic;
+        } else if (code == 4) {
+            style->attributes |= StyleUnderline;
+        } else if (code == 7) {
+            style->attributes |= StyleReverse;
+        } else if ((code >= 30 && code <= 37) || (code >= 90 && code <= 97)) {
+            style->fg = code;
+        } else if (code == 39) {
+            style->fg = 0;
+        } else if ((code >= 40 && code <= 47) || (code >= 100 && code <= 107)) {
+            style->bg = code;
+        } else if (code == 49) {
+            style->bg = 0;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool StyleEqual(Style a, Style b) {
+    return a.fg == b.fg && a.bg == b.bg && a.attributes == b.attributes;
+}
+
+/// Whether anything of a space shows up on screen
+bool StyleHasBlankInk(Style style) {
+    return style.bg || (style.attributes & (StyleUnderline | StyleReverse));
+}
+
+/// Writes the shortest SGR sequence turning `from` into `to`, nul-terminated.
+/// Either the attributes that differ get switched one by one, or everything
+/// gets reset and `to` is set up from scratch, whichever is shorter
+u32 StyleTransition(Style from, Style to, char *buffer) {
+    buffer[0] = '\0';
+    if (StyleEqual(from, to)) return 0;
+
+    static u8 attribute_codes[] = {1, 2, 3, 4, 7};
+
+    // from scratch
+    u8  reset[16] = {0};
+    u32 reset_count = 1;
+    for (u32 i = 0; i < sizeof(attribute_codes); i += 1) {
+        if (to.attributes & (1 << i)) reset[reset_count++] = attribute_codes[i];
+    }
+    if (to.fg) reset[reset_count++] = to.fg;
+    if (to.bg) reset[reset_count++] = to.bg;
+
+    // one by one. Bold and dim are both turned off by 22
+    u8  diff[16] = {0};
+    u32 diff_count = 0;
+    u8  off = from.attributes & ~to.attributes;
+    u8  on = to.attributes & ~from.attributes;
+    if (off & (StyleBold | StyleDim)) {
+        diff[diff_count++] = 22;
+        on |= to.attributes & (StyleBold | StyleDim);
+    }
+    if (off & StyleItalic) diff[diff_count++] = 23;
+    if (off & StyleUnderline) diff[diff_count++] = 24;
+    if (off & StyleReverse) diff[diff_count++] = 27;
+    for (u32 i = 0; i < sizeof(attribute_codes); i += 1) {
+        if (on & (1 << i)) diff[diff_count++] = attribute_codes[i];
+    }
+    if (from.fg != to.fg) diff[diff_count++] = to.fg ? to.fg : 39;
+    if (from.bg != to.bg) diff[diff_count++] = to.bg ? to.bg : 49;
+
+    char reset_buffer[STYLE_MAX_SGR];
+    u32  reset_len = StyleFormat(reset, reset_count, reset_buffer);
+    u32  diff_len = StyleFormat(diff, diff_count, buffer);
+    if (reset_len <= diff_len) {
+        memcpy(buffer, reset_buffer, reset_len + 1);
+        return reset_len;
+    }
+    return diff_len;
+}
+
+/// "\x1b[" codes joined by ';' "m"
+u32 StyleFormat(u8 *codes, u32 count, char *buffer) {
+    u32 len = 0;
+    buffer[len++] = '\x1b';
+    buffer[len++] = '[';
+    for (u32 i = 0; i < count; i += 1) {
+        if (i != 0) buffer[len++] = ';';
+        len += snprintf(buffer + len, STYLE_MAX_SGR - len, "%u", codes[i]);
+    }
+    buffer[len++] = 'm';
+    buffer[len] = '\0';
+    assert(len < STYLE_MAX_SGR && "SGR sequence too long");
+    return len;
+}
+
+/// Sets styles from a spec like "keyword=1;33:string=32", where `names[i]`
+/// is the name of style `i`, if it has one. Returns false if the spec has
+/// something it can't make sense of, the styles before it stay applied
+bool StyleThemeApply(StyleTheme *this, char *spec, char **names, u32 name_count) {
+    assert(name_count <= STYLE_MAX && "too many styles for a theme");
+    if (this->len < name_count) this->len = name_count;
+
+    char *item = spec;
+    while (*item) {
+        char *end = item;
+        while (*end && *end != ':')
+            end += 1;
+        char *equals = memchr(item, '=', end - item);
+        if (equals == NULL) return false;
+
+        // styles without a name can't be changed
+        u32 style = 0;
+        u32 name_len = equals - item;
+        while (style < name_count &&
+               !(names[style] && strlen(names[style]) == name_len &&
+                 memcmp(names[style], item, name_len) == 0))
+            style += 1;
+        if (style == name_count) return false;
+
+        // a style is set as a whole, it doesn't add to the previous one
+        Style parsed = {0};
+        if (!StyleParse(equals + 1, end - equals - 1, &parsed)) return false;
+        this->styles[style] = parsed;
+
+        item = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+/// Precomputes the transitions between every pair of styles
+void StyleThemeBake(StyleTheme *this) {
+    ArenaReset(&this->arena);
+    for (u32 from = 0; from < this->len; from += 1) {
+        for (u32 to = 0; to < this->len; to += 1) {
+            char buffer[STYLE_MAX_SGR];
+            u32  len = StyleTransition(this->styles[from], this->styles[to], buffer);
+            this->transitions[from][to] = ArenaAlloc(&this->arena, len + 1);
+            memcpy(this->transitions[from][to], buffer, len + 1);
+            this->same_blank[from][to] = !StyleHasBlankInk(this->styles[from]) &&
+                                         !StyleHasBlankInk(this->styles[to]);
+        }
+    }
+}
@@ -3,15 +3,24 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include "arena.h"
+#include "buffer.h"
 #include "core.h"
+#include "event.h"
+#include "executor.h"
 #include "history.h"
+#include "output.h"
+#include "screen.h"
 #include "string.h"
 #include "token.h"
+#include "undo.h"
+#include "utf8.h"
 
 #define TERM_ESCAPE      "\x1b"
 #define TERM_ESCAPE_CHAR '\x1b'
@@ -24,6 +33,19 @@
 #define TERM_REQUEST_POSITION  TERM_ESCAPE "[6n"
 #define TERM_LINE_WRAPPING     TERM_ESCAPE "[?7l"
 #define TERM_GO_ONE_LINE_UP    TERM_ESCAPE "[1A"
+#define TERM_PASTE_ENABLE      TERM_ESCAPE "[?2004h"
+#define TERM_PASTE_DISABLE     TERM_ESCAPE "[?2004l"
+
+// Window title, used for the running indicator
+#define TERM_TITLE_PUSH TERM_ESCAPE "[22;0t"
+#define TERM_TITLE_POP  TERM_ESCAPE "[23;0t"
+#define TERM_TITLE_SET  TERM_ESCAPE "]2;"
+#define TERM_TITLE_END  "\x07"
+
+// Bracketed paste markers, sent around the pasted text
+#define TERM_PASTE_START      TERM_ESCAPE "[200~"
+#define TERM_PASTE_END        TERM_ESCAPE "[201~"
+#define TERM_PASTE_MARKER_LEN 6
 
 #define TERM_STYLE_RESET   TERM_ESCAPE "[0m"
 #define TERM_STYLE_BOLD    TERM_ESCAPE "[1m"
@@ -34,11 +56,61 @@
 // Keycodes
 #define TERM_DEL       0x7F
 #define TERM_EOF       0x4
+#define TERM_INTERRUPT 0x3
 #define TERM_BACKSPACE '\b'
+#define TERM_UNDO      0x1F
 #define TERM_ARROW_UP  '\x1bA'
 
-#define TERM_PROMPT_NEW      TERM_STYLE_BOLD TERM_STYLE_BRBLUE ">>>" TERM_STYLE_RESET " "
-#define TERM_PROMPT_CONTINUE TERM_STYLE_BOLD TERM_STYLE_BRBLACK "..." TERM_STYLE_RESET " "
+#define TERM_PROMPT_NEW      ">>> "
+#define TERM_PROMPT_CONTINUE "... "
+#define TERM_PROMPT_LEN      4
+
+/// Size of the input ring, must be a power of two
+#define TERM_INPUT_RING_CAP (1 << 14)
+#define TERM_INPUT_RING_MASK (TERM_INPUT_RING_CAP - 1)
+
+/// How long to wait for the rest of an escape sequence before
+/// taking the escape as a key on its own
+#define TERM_ESCAPE_TIMEOUT_MS 25
+
+/// Parameters kept from a CSI sequence, the rest are dropped
+#define TERM_CSI_MAX_PARAMS 4
+
+#define TERM_MODIFIER_SHIFT 1
+#define TERM_MODIFIER_ALT   2
+#define TERM_MODIFIER_CTRL  4
+
+/// A running cell shows up in the title once it takes longer
+/// than the delay, the elapsed time is updated every interval
+#define TERM_INDICATOR_DELAY_MS    250
+#define TERM_INDICATOR_INTERVAL_MS 100
+
+/// Damage range that spans every line till the end of the input
+#define TERM_DAMAGE_TO_END UINT32_MAX
+
+/// No input line at all
+#define TERM_NO_LINE UINT32_MAX
+
+/// Narrowest window of a long line, markers included
+#define TERM_MIN_WINDOW 8
+
+/// Markers of a line cut off on the left/right side of the screen
+#define TERM_OVERFLOW_LEFT  '<'
+#define TERM_OVERFLOW_RIGHT '>'
+
+/// Under a burst of input frames are painted at most this often, the keys
+/// in between get coalesced. A key after a pause is painted right away
+#define TERM_FRAME_INTERVAL_MS 8
+
+/// Overrides `TERM_FRAME_INTERVAL_MS`, `DY_FRAME_MS=0` paints every burst
+#define TERM_FRAME_ENV "DY_FRAME_MS"
+
+/// `DY_STATS=1` reports the output bytes and syscalls per key at exit
+#define TERM_STATS_ENV "DY_STATS"
+
+/// Picks a built-in theme and/or overrides its styles with SGR
+/// parameters, as in `DY_THEME=light:keyword=1;35:comment=3;90`
+#define TERM_THEME_ENV "DY_THEME"
 
 typedef struct {
     u32 row, col;
@@ -49,59 +121,298 @@ typedef enum TerminalInputStatus {
     TerminalInputStatusNone = 0,
     Eof,
 
+    /// Ctrl-C
+    Interrupt,
+
+    /// Nothing left to decode, wait for the next event
+    Pending,
+
     /// Arrows
     ArrowUp,
     ArrowDown,
     ArrowLeft,
     ArrowRight,
 
+    /// Ctrl/Alt with arrows, alt-b and alt-f
+    WordLeft,
+    WordRight,
+
+    Home,
+    End,
+    Delete,
+
     /// Special key-codes
     NewLine,
     Backspace,
 
-    /// Alphanumeric character
+    /// Bracketed paste is over, the text is in `Terminal.paste`
+    Paste,
+
+    /// Ctrl-_ (Ctrl-/ on most terminals) and alt-_, as in Emacs' undo-tree
+    Undo,
+    Redo,
+
+    /// A printable character, its bytes are in `TerminalChar`
     Char,
 } TerminalInputStatus;
 
+/// A typed character, a single code point in UTF-8
+typedef struct TerminalChar {
+    char bytes[4];
+    u32  len;
+} TerminalChar;
+
 typedef struct TerminalPositions {
     TerminalPosition *ptr;
     u32               len, cap;
 } TerminalPositions;
 
+/// Raw bytes read from stdin that are yet to be decoded
+typedef struct TerminalInputRing {
+    u8 buffer[TERM_INPUT_RING_CAP];
+
+    /// Free-running offsets, only masked on access
+    u32 read, write;
+} TerminalInputRing;
+
+typedef enum TerminalDecoderState {
+    TerminalDecoderGround = 0,
+
+    /// After ESC
+    TerminalDecoderEscape,
+
+    /// After ESC [, collecting parameters till the final byte
+    TerminalDecoderCsi,
+
+    /// After ESC O, the next byte is the key
+    TerminalDecoderSs3,
+
+    /// Inside a UTF-8 sequence, collecting its continuation bytes
+    TerminalDecoderUtf8,
+} TerminalDecoderState;
+
+/// Escape sequence parser, its state survives between reads
+/// so a sequence split across them is never mis-parsed
+typedef struct TerminalDecoder {
+    TerminalDecoderState state;
+
+    u32 params[TERM_CSI_MAX_PARAMS];
+    u32 param_count;
+
+    /// Sequence has private markers or intermediates, it's skipped
+    bool ignored;
+
+    /// UTF-8 sequence collected so far, and how long it is going to be
+    TerminalChar utf8;
+    u32          utf8_len;
+
+    /// Nothing arrived within `TERM_ESCAPE_TIMEOUT_MS` after a partial sequence
+    bool timed_out;
+} TerminalDecoder;
+
+/// What a cell of the screen can look like
+typedef enum TerminalStyle {
+    TerminalStyleDefault = 0,
+    TerminalStylePromptNew,
+    TerminalStylePromptContinue,
+    TerminalStyleNumber,
+    TerminalStyleComment,
+    TerminalStyleString,
+    TerminalStyleKeyword,
+    TerminalStylePunct,
+    TerminalStyleOverflow,
+    TerminalStyleCount,
+} TerminalStyle;
+
+/// How the styles are called in `DY_THEME`. The default one is
+/// whatever the terminal is set up with, it has no name
+static char *TerminalStyleNames[TerminalStyleCount] = {
+    [TerminalStylePromptNew] = "prompt",
+    [TerminalStylePromptContinue] = "continue",
+    [TerminalStyleNumber] = "number",
+    [TerminalStyleComment] = "comment",
+    [TerminalStyleString] = "string",
+    [TerminalStyleKeyword] = "keyword",
+    [TerminalStylePunct] = "punct",
+    [TerminalStyleOverflow] = "overflow",
+};
+
+typedef struct TerminalThemePreset {
+    char *name;
+    char *spec;
+} TerminalThemePreset;
+
+/// Built-in themes, the first one is used unless `DY_THEME` picks another
+static TerminalThemePreset TerminalThemes[] = {
+    {"dark", "prompt=1;94:continue=1;90:number=94:comment=90:string=91:keyword=1;33:punct=90:"
+             "overflow=7"},
+    {"light", "prompt=1;34:continue=1;90:number=34:comment=90:string=31:keyword=1;35:punct=90:"
+              "overflow=7"},
+    {"plain", "overflow=7"},
+};
+
+/// Style of each `TokenType`, filled in once by `TerminalLoadTheme`
+static TerminalStyle TerminalTokenStyles[TokenTypeCount];
+
+/// Styles and the transitions between them, baked at startup
+static StyleTheme TerminalTheme;
+
+/// Range of lines, [first, last], that have to be repainted
+typedef struct TerminalDamage {
+    u32 first, last;
+
+    /// Lines past `last` were at `line - shift` in the previous frame
+    i32 shift;
+} TerminalDamage;
+
+/// Columns of a line on the screen, the prompt aside
+typedef struct TerminalWindow {
+    /// First column of the line shown, and how many are
+    u32 left, len;
+
+    /// Cut off on either side, shown by a marker there
+    bool clipped_left, clipped_right;
+} TerminalWindow;
+
+/// Lexer state at the start of each input line
+typedef struct TerminalLineStates {
+    ArrayHeader     header;
+    TokenizerState *buffer;
+} TerminalLineStates;
+
 typedef struct {
     struct termios handle;
 
     /// Dimension of the terminal
     u32 width, height;
 
-    /// Terminal input
-    String input;
+    /// Terminal input, edited in place at the cursor
+    GapBuffer input;
 
     /// Cursor position
     TerminalPosition pos;
 
+    /// First input line on the screen. Only the lines that fit the
+    /// terminal's height are painted, the window follows the cursor
+    u32 top;
+
+    /// A line too wide for the screen shows a window of its columns, the
+    /// one under the cursor has it start at `left`, the others at 0
+    u32 left, left_row;
+
     /// REPL history
     ReplHistory history;
 
     /// Index offset in the REPL history array.
     u32 history_index;
+
+    /// Sources the input loop sleeps on
+    EventLoop events;
+    u32       input_source;
+    u32       resize_source;
+    u32       done_source;
+
+    /// Runs the cells, NULL until `TerminalAttachExecutor`
+    Executor *executor;
+
+    /// Line a running cell reads with `input()`, as the editor reads it
+    String read_line;
+    Arena  read_arena;
+
+    /// Bytes of the current input burst
+    TerminalInputRing ring;
+    TerminalDecoder   decoder;
+
+    /// Text of a bracketed paste, collected across reads
+    String paste;
+    bool   pasting;
+    bool   paste_after_cr;
+
+    /// Lines edited since the last refresh
+    TerminalDamage damage;
+
+    /// Keys got applied since the last frame, which was painted at
+    /// `frame_at_ms`. Another one is due `frame_interval_ms` after it
+    bool frame_pending;
+    u64  frame_at_ms;
+    u32  frame_interval_ms;
+
+    /// Kept across refreshes, so only edited lines get lexed again
+    TerminalLineStates line_states;
+    Arena              lex_arena;
+
+    /// Where lexing can resume along the long line being edited,
+    /// `checkpoint_line` is `TERM_NO_LINE` if there is none
+    TokenizerCheckpoints checkpoints;
+    u32                  checkpoint_line;
+
+    /// Columns along the cursor line, `columns_line` is `TERM_NO_LINE`
+    /// until some line needs them
+    Utf8Columns columns;
+    u32         columns_line;
+
+    /// Transient allocations, dropped after every frame: the cell offsets of
+    /// the line being laid out, text indented on its way into the input
+    Arena scratch;
+
+    /// What the terminal shows, the cursor there lags behind `pos`
+    /// until the next refresh
+    Screen screen;
+
+    /// Edits of the current input, for undo and redo
+    UndoLog undo;
 } Terminal;
 
 /// Initialize the terminal
 Terminal TerminalSetup(void);
 
+/// Give the terminal back in the state it was before `TerminalSetup`
+void TerminalRestore(void);
+
 /// Update terminal dimestions, useful for handling resizes
 void TerminalUpdateDimension(Terminal *terminal);
+void TerminalHandleResize(Terminal *terminal);
 
 TerminalInputStatus TerminalReadLine(Terminal *terminal, Arena *input_arena, Arena *history_arena);
-TerminalInputStatus TerminalInput(Terminal *terminal, Arena *input_arena, char *c);
+void TerminalApplyKey(Terminal *terminal, Arena *input_arena, TerminalInputStatus key,
+                      TerminalChar *typed);
+
+void TerminalAttachExecutor(Terminal *terminal, Executor *executor);
+void TerminalWaitExecution(Terminal *terminal, Executor *executor, Arena *input_arena);
+void TerminalPreEdit(Terminal *terminal, Arena *input_arena);
+void TerminalStartRead(Terminal *terminal, Arena *input_arena, const char *prompt);
+bool TerminalReadAnswer(Terminal *terminal, Executor *executor, Arena *input_arena, bool hung_up);
+void TerminalReleaseStdin(Terminal *terminal);
+void TerminalTakeStdin(Terminal *terminal);
+bool TerminalTakeInterrupt(Terminal *terminal, u32 from);
+TerminalInputStatus TerminalInput(Terminal *terminal, Arena *input_arena, TerminalChar *typed);
+TerminalInputStatus TerminalInputPaste(Terminal *terminal, Arena *input_arena);
+TerminalInputStatus TerminalDecodeCsi(TerminalDecoder *decoder, char final);
+bool                TerminalWaitInput(Terminal *terminal);
+bool                TerminalFillInput(Terminal *terminal);
+
+u32 TerminalInputRingLen(TerminalInputRing *ring);
+u8  TerminalInputRingPeek(TerminalInputRing *ring, u32 offset);
+void TerminalInputRingConsume(TerminalInputRing *ring, u32 count);
+u32  TerminalInputRingMatch(TerminalInputRing *ring, char *sequence, u32 len);
 
 void TerminalStartNewLine(Terminal *terminal, Arena *arena);
 void TerminalHistoryAdd(Terminal *terminal, Arena *history_arena);
 
-void TerminalInsertCharAtCursor(Terminal *terminal, Arena *arena, char c);
+void TerminalInsertNewLine(Terminal *terminal, Arena *arena);
+void TerminalInsertStringAtCursor(Terminal *terminal, Arena *arena, String *text);
 void TerminalRemoveCharAtCursor(Terminal *terminal, Arena *arena);
+void TerminalDeleteCharAtCursor(Terminal *terminal, Arena *arena);
+
+TerminalDamage TerminalReplaceAt(Terminal *terminal, Arena *arena, u32 offset, u32 len,
+                                 char *text, u32 text_len);
+TerminalDamage TerminalEditSpan(Terminal *terminal, Arena *arena, u32 offset, u32 len,
+                                String *text, bool indent);
+void TerminalReplaceInput(Terminal *terminal, Arena *arena, String *text);
+void TerminalUndo(Terminal *terminal, Arena *arena);
+void TerminalRedo(Terminal *terminal, Arena *arena);
 
+void TerminalMoveCursorTo(Terminal *terminal, u32 offset);
 void TerminalMoveCursorUpBy(Terminal *terminal, u32 by);
 void TerminalMoveCursorDownBy(Terminal *terminal, u32 by);
 void TerminalHistoryUp(Terminal *terminal, Arena *input_arena);
@@ -109,9 +420,14 @@ void TerminalHistoryDown(Terminal *terminal, Arena *input_arena);
 
 void TerminalMoveCursorLeft(Terminal *terminal);
 void TerminalMoveCursorRight(Terminal *terminal);
+void TerminalMoveCursorWordLeft(Terminal *terminal);
+void TerminalMoveCursorWordRight(Terminal *terminal);
 void TerminalEnsureColumnPosition(Terminal *terminal);
+u32  TerminalCursorColumn(Terminal *terminal);
+u32  TerminalColumnOffset(Terminal *terminal, u32 row, u32 column);
 
 String TerminalGetCursorLine(Terminal *terminal);
+String TerminalCursorLineView(Terminal *terminal);
 String TerminalGetPreviousLine(Terminal *terminal);
 
 void TerminalEraseUntilEnd(void);
@@ -120,33 +436,106 @@ void TerminalSavePosition(void);
 void TerminalRestorePosition(void);
 void TerminalEnableWrapping(void);
 void TerminalResetInput(Terminal *terminal);
+void TerminalDiscardInput(Terminal *terminal);
 
 void TerminalFlush(void);
+void TerminalDamageLines(Terminal *terminal, u32 first, u32 last);
+void TerminalShiftLines(Terminal *terminal, u32 at, i32 delta);
+u32  TerminalShiftLine(u32 line, u32 at, i32 delta);
+void TerminalSyncLineStates(Terminal *terminal);
+TokenizerState TerminalLineState(Terminal *terminal, u32 row);
+u32  TerminalViewportTop(Terminal *terminal, u32 line_count, u32 row);
+void TerminalEditLine(Terminal *terminal, u32 row, u32 col, i32 delta);
+Utf8Columns *TerminalColumns(Terminal *terminal, u32 row, String *line);
+
+TerminalWindow TerminalLineWindow(Terminal *terminal, u32 line_width, u32 left);
+u32            TerminalWindowLeft(Terminal *terminal, u32 line_width, u32 column);
+bool TerminalFrameDue(Terminal *terminal);
+i32  TerminalFrameWaitMs(Terminal *terminal);
+void TerminalRefresh(Terminal *terminal);
+void TerminalRefreshSubmitted(Terminal *terminal);
 void TerminalRender(Terminal *terminal);
-void TerminalPrintLineHighlighted(Terminal *terminal, String *line, u32 line_idx);
-void TerminalReRenderCursorLine(Terminal *terminal);
-void TerminalReRenderLinesBelowCursor(Terminal *terminal);
+void TerminalRenderFrame(Terminal *terminal, u32 line_count);
+TokenizerState TerminalLayoutLine(Terminal *terminal, String *line, u32 line_idx,
+                                  TokenizerState state);
+TerminalStyle TerminalTokenStyle(TokenType type);
+void          TerminalLoadTheme(void);
+
+/// Terminal settings prior to `TerminalSetup`
+static struct termios TerminalOriginalHandle;
+
+/// Pending frame. Everything the editor paints goes through it
+static Output TerminalOutput;
+
+/// Keys decoded so far, the denominator of `TERM_STATS_ENV`
+static u64 TerminalKeyCount;
+
+/// Frames painted so far, for `TERM_STATS_ENV`
+static u64 TerminalFrameCount;
 
 Terminal TerminalSetup(void) {
     struct termios handle = {0};
     tcgetattr(STDIN_FILENO, &handle);
+    TerminalOriginalHandle = handle;
 
     // set noncanonical mode and unset echo:
     //   don't render typed input - those will be printed anyway
     handle.c_lflag &= ~(ICANON | ECHO);
 
+    // Ctrl-C arrives as a byte: at the prompt it discards the input and
+    // while a cell runs the editor forwards it. Ctrl-Z and Ctrl-\ still
+    // send their signals
+    handle.c_cc[VINTR] = _POSIX_VDISABLE;
+
     // non blocking read
     handle.c_cc[VMIN] = 0;
     handle.c_cc[VTIME] = 0;
 
     tcsetattr(STDIN_FILENO, TCSANOW, &handle);
+
+    // a frame is written once per input burst, stdio is left to Python
+    TerminalOutput = (Output){.fd = STDOUT_FILENO};
+
+    // pastes come wrapped in markers, so they don't get auto-indented;
+    // a cell calling `exit()` must not leave the shell in paste mode
+    OutputPuts(&TerminalOutput, TERM_PASTE_ENABLE);
+    atexit(TerminalRestore);
+    TerminalLoadTheme();
+
     Terminal terminal = {
         .handle = handle,
+        .damage = {.first = TERM_DAMAGE_TO_END, .last = 0},
+        .screen = {.theme = &TerminalTheme},
+        .checkpoint_line = TERM_NO_LINE,
+        .columns_line = TERM_NO_LINE,
+        .undo = {.last = UNDO_NONE},
+        .frame_interval_ms = TERM_FRAME_INTERVAL_MS,
     };
+    char *frame_ms = getenv(TERM_FRAME_ENV);
+    if (frame_ms && *frame_ms) terminal.frame_interval_ms = strtoul(frame_ms, NULL, 10);
+    terminal.input_source = EventLoopAdd(&terminal.events, STDIN_FILENO);
+    terminal.resize_source = EventLoopAddSignal(&terminal.events, SIGWINCH);
     TerminalUpdateDimension(&terminal);
     return terminal;
 }
 
+void TerminalRestore(void) {
+    OutputPuts(&TerminalOutput, TERM_PASTE_DISABLE);
+    TerminalFlush();
+    tcsetattr(STDIN_FILENO, TCSANOW, &TerminalOriginalHandle);
+
+    if (getenv(TERM_STATS_ENV)) {
+        OutputStats stats = TerminalOutput.stats;
+        u64         keys = TerminalKeyCount ? TerminalKeyCount : 1;
+        fprintf(stderr,
+                "dy: %llu keys, %llu frames, %llu bytes in %llu writes "
+                "(%.1f bytes, %.2f writes per key)\n",
+                (unsigned long long)TerminalKeyCount, (unsigned long long)TerminalFrameCount,
+                (unsigned long long)stats.bytes, (unsigned long long)stats.writes,
+                (double)stats.bytes / keys, (double)stats.writes / keys);
+    }
+}
+
 void TerminalUpdateDimension(Terminal *terminal) {
     struct winsize window;
     ioctl(STDOUT_FILENO, TIOCGWINSZ, &window);
@@ -154,61 +543,83 @@ void TerminalUpdateDimension(Terminal *terminal) {
     terminal->height = window.ws_row;
 }
 
-// TODO: in the future this should get refactored
-//       to allow lexing and syntax highlighting
+/// Picks up the new geometry after SIGWINCH. Lines are laid out by width,
+/// a change of height only matters when the input doesn't fit the screen
+void TerminalHandleResize(Terminal *terminal) {
+    if (!EventLoopTakeSignal(&terminal->events, terminal->resize_source)) return;
+
+    u32 old_width = terminal->width, old_height = terminal->height;
+    TerminalUpdateDimension(terminal);
+    u32  line_count = GapBufferLineCount(&terminal->input);
+    bool clipped = line_count > old_height || line_count > terminal->height;
+    if (terminal->width != old_width || (terminal->height != old_height && clipped)) {
+        // wrapped lines got reflowed, who knows what the screen looks like
+        terminal->screen.stale = true;
+        TerminalDamageLines(terminal, 0, TERM_DAMAGE_TO_END);
+    }
+}
+
 TerminalInputStatus TerminalReadLine(Terminal *terminal, Arena *input_arena, Arena *history_arena) {
     TerminalInputStatus status;
     while (true) {
-        char c = 0;
-        status = TerminalInput(terminal, input_arena, &c);
+        TerminalChar typed = {0};
+        status = TerminalInput(terminal, input_arena, &typed);
+        if (status != Pending) {
+            TerminalKeyCount += 1;
+            terminal->frame_pending = true;
+        }
 
         switch (status) {
             case 0:
                 break;
 
-            case Eof: {
-                putc('\n', stdout);
-                return Eof;
-            } break;
-
-            case ArrowUp: {
-                if (terminal->pos.row != 0) {
-                    TerminalMoveCursorUpBy(terminal, 1);
-                } else if (terminal->history_index != 0 && !(ArrayIsEmpty(&terminal->history))) {
-                    TerminalEraseUntilEnd();
-                    TerminalHistoryUp(terminal, input_arena);
+            case Pending: {
+                /* the whole burst got applied, paint it at once unless a
+                   frame went out a moment ago: then the next keys join it */
+                if (TerminalFrameDue(terminal)) {
+                    TerminalRefresh(terminal);
+                    TerminalFlush();
                 }
-            } break;
-
-            case ArrowDown: {
-                u32 total_lines = StringCount(&terminal->input, '\n') + 1;
-                if (terminal->pos.row + 1 != total_lines) {
-                    TerminalMoveCursorDownBy(terminal, 1);
-                } else if (!(ArrayIsEmpty(&terminal->history)) &&
-                           terminal->history_index + 1 != ArrayLen(&terminal->history)) {
-                    TerminalEraseUntilEnd();
-                    TerminalHistoryDown(terminal, input_arena);
+                if (!TerminalWaitInput(terminal)) {
+                    status = Eof;
+                    OutputPutc(&TerminalOutput, '\n');
+                    TerminalFlush();
+                    return Eof;
                 }
             } break;
 
-            case ArrowLeft: {
-                TerminalMoveCursorLeft(terminal);
+            case Eof: {
+                TerminalRefresh(terminal);
+                OutputPutc(&TerminalOutput, '\n');
+                TerminalFlush();
+                return Eof;
             } break;
 
-            case ArrowRight: {
-                TerminalMoveCursorRight(terminal);
+            case Interrupt: {
+                TerminalDiscardInput(terminal);
+                ArenaReset(input_arena);
+                TerminalStartNewLine(terminal, input_arena);
             } break;
 
             case NewLine: {
-                TerminalInsertCharAtCursor(terminal, input_arena, '\n');
-                u32    total_lines = StringCount(&terminal->input, '\n') + 1;
-                String last_edited_line = StringNthLine(&terminal->input, terminal->pos.row - 1);
+                UndoLogBeginStep(&terminal->undo, UndoRunNone);
+                TerminalInsertNewLine(terminal, input_arena);
+                u32 total_lines = GapBufferLineCount(&terminal->input);
                 assert(terminal->pos.row < total_lines);
-                if (terminal->pos.row + 1 == total_lines) {
+                if (terminal->pos.row + 1 != total_lines) break;
+
+                // an open bracket, string or a trailing backslash keeps the cell going.
+                // Only the lines edited since the last frame get lexed for it
+                TokenizerState state = TerminalLineState(terminal, terminal->pos.row);
+                String         last_line = GapBufferNthLine(&terminal->input, terminal->pos.row);
+                TokenizerState end = TokenizerEndState(&last_line, state);
+                // slicing may move the gap, the line is taken after it
+                String last_edited_line = GapBufferNthLine(&terminal->input, terminal->pos.row - 1);
+                if (TokenizerStateIsClosed(end)) {
                     if (StringIsSpace(&last_edited_line) ||
                         (StringIndentationLevel(&last_edited_line) == 0 &&
                          StringIsPyTerminated(&last_edited_line))) {
-                        TerminalClearLine();
+                        TerminalRefreshSubmitted(terminal);
                         TerminalFlush();
                         goto exit;
                     }
@@ -216,169 +627,836 @@ TerminalInputStatus TerminalReadLine(Terminal *terminal, Arena *input_arena, Are
 
             } break;
 
-            case Backspace:
-                TerminalRemoveCharAtCursor(terminal, input_arena);
-                break;
-
-            case Char:
-                TerminalInsertCharAtCursor(terminal, input_arena, c);
+            default:
+                TerminalApplyKey(terminal, input_arena, status, &typed);
                 break;
         }
-
-        /* flush after each iteration */
-        TerminalFlush();
     }
 exit:
-    if (!StringIsSpace(&terminal->input)) {
+    if (!GapBufferIsSpace(&terminal->input)) {
         TerminalHistoryAdd(terminal, history_arena);
     }
     return status;
 }
 
-// TODO: UTF-8 support
-TerminalInputStatus TerminalInput(Terminal *terminal, Arena *arena, char *c) {
-    i32 num_read = read(STDIN_FILENO, c, 1);
-    if (num_read == 0) return false;
+/// Lets the event loop wake up when a cell is done
+void TerminalAttachExecutor(Terminal *terminal, Executor *executor) {
+    terminal->executor = executor;
+    terminal->done_source = EventLoopAdd(&terminal->events, executor->done_pipe[0]);
+}
+
+/// Keeps the editor going while a cell runs. Typed keys are applied to the
+/// next input without painting anything, Python owns the screen meanwhile.
+/// The elapsed time is shown in the window title, so it never gets mixed
+/// with the cell's output.
+///
+/// Input keeps being read past a queued Enter, so Ctrl-C gets
+/// through no matter how much was typed ahead.
+///
+/// A cell reading the terminal gets it: `input()` has the editor read its
+/// line, and while the cell reads stdin itself the editor doesn't
+void TerminalWaitExecution(Terminal *terminal, Executor *executor, Arena *input_arena) {
+    EventLoop *events = &terminal->events;
+    bool       done = false, hung_up = false, titled = false;
+    bool       reading = false, released = false;
+    u32        unscanned = terminal->ring.read;
+    while (!done) {
+        if (TerminalTakeInterrupt(terminal, unscanned)) {
+            ArenaReset(input_arena);
+            TerminalResetInput(terminal);
+            // a line being read is dropped along, `input()` raises
+            ExecutorInterrupt(executor);
+            if (reading) {
+                OutputPuts(&TerminalOutput, "^C\n");
+                TerminalFlush();
+            }
+            reading = false;
+        }
+        unscanned = terminal->ring.write;
+
+        // a direct read of stdin is over, the editor takes the terminal back
+        if (released && !ExecutorReadsStdin(executor)) {
+            TerminalTakeStdin(terminal);
+            released = false;
+        }
+        const char  *prompt;
+        ExecutorRead read = ExecutorPendingRead(executor, &prompt);
+        if (read == ExecutorReadRaw) {
+            if (!released) TerminalReleaseStdin(terminal);
+            released = true;
+            ExecutorAnswer(executor, NULL, 0);
+        } else if (read == ExecutorReadLine && !reading) {
+            TerminalStartRead(terminal, input_arena, prompt);
+            reading = true;
+        }
+
+        if (reading) {
+            reading = TerminalReadAnswer(terminal, executor, input_arena, hung_up);
+        } else {
+            TerminalPreEdit(terminal, input_arena);
+        }
+        bool ring_full = TerminalInputRingLen(&terminal->ring) == TERM_INPUT_RING_CAP;
+        EventLoopSetEnabled(events, terminal->input_source, !ring_full && !hung_up && !released);
+
+        u64 elapsed = ExecutorElapsedMs(executor);
+        if (elapsed >= TERM_INDICATOR_DELAY_MS) {
+            if (!titled) OutputPuts(&TerminalOutput, TERM_TITLE_PUSH);
+            titled = true;
+            OutputPrintf(&TerminalOutput, "%sdy: running %llu.%llus%s", TERM_TITLE_SET,
+                         (unsigned long long)elapsed / 1000,
+                         (unsigned long long)elapsed % 1000 / 100, TERM_TITLE_END);
+            TerminalFlush();
+        }
+
+        bool in_sequence = !terminal->pasting && terminal->decoder.state != TerminalDecoderGround;
+        i32  timeout = in_sequence ? TERM_ESCAPE_TIMEOUT_MS : TERM_INDICATOR_INTERVAL_MS;
+        if (EventLoopWait(events, timeout) == 0) {
+            if (in_sequence) terminal->decoder.timed_out = true;
+            continue;
+        }
+        if (EventLoopIsReadable(events, terminal->done_source)) {
+            done = ExecutorTakeDone(executor);
+        }
+        if (EventLoopIsReadable(events, terminal->resize_source)) {
+            TerminalHandleResize(terminal);
+        }
+        if (EventLoopIsReadable(events, terminal->input_source)) {
+            if (!TerminalFillInput(terminal)) hung_up = true;
+        } else if (EventLoopIsHangUp(events, terminal->input_source)) {
+            hung_up = true;
+        }
+    }
+    if (released) TerminalTakeStdin(terminal);
+    TerminalPreEdit(terminal, input_arena);
+    EventLoopSetEnabled(events, terminal->input_source, true);
+    if (titled) {
+        OutputPuts(&TerminalOutput, TERM_TITLE_POP);
+        TerminalFlush();
+    }
+}
+
+/// Applies queued keys up to the first Enter or EOF, those are left in
+/// the ring for the next prompt
+void TerminalPreEdit(Terminal *terminal, Arena *input_arena) {
+    TerminalInputRing *ring = &terminal->ring;
+    while (true) {
+        bool at_ground = !terminal->pasting && terminal->decoder.state == TerminalDecoderGround;
+        if (at_ground && TerminalInputRingLen(ring) != 0) {
+            u8 next = TerminalInputRingPeek(ring, 0);
+            if (next == '\n' || next == TERM_EOF) return;
+        }
+
+        TerminalChar        typed = {0};
+        TerminalInputStatus key = TerminalInput(terminal, input_arena, &typed);
+        if (key == Pending) return;
+        TerminalKeyCount += 1;
+        TerminalApplyKey(terminal, input_arena, key, &typed);
+    }
+}
+
+/// A cell called `input()`, its prompt goes up. What was typed ahead while
+/// the cell ran goes to the read, as it would on a tty, unless it spans lines:
+/// that's a paste meant for the next input
+void TerminalStartRead(Terminal *terminal, Arena *input_arena, const char *prompt) {
+    ArenaReset(&terminal->read_arena);
+    terminal->read_line = (String){0};
+    if (prompt) OutputPuts(&TerminalOutput, (char *)prompt);
+
+    GapBuffer *input = &terminal->input;
+    if (GapBufferLineCount(input) == 1 && GapBufferLen(input) != 0) {
+        terminal->read_line = GapBufferCopy(input, &terminal->read_arena);
+        OutputAppend(&TerminalOutput, terminal->read_line.buffer, terminal->read_line.len);
+        ArenaReset(input_arena);
+        TerminalResetInput(terminal);
+    }
+    TerminalFlush();
+}
+
+/// Applies the queued keys to the line `input()` waits for, echoing them like
+/// the tty driver would. Enter answers the read, so does Ctrl-D on an empty
+/// line or a hang-up, with EOF. Returns whether the read goes on
+bool TerminalReadAnswer(Terminal *terminal, Executor *executor, Arena *input_arena, bool hung_up) {
+    String *line = &terminal->read_line;
+    Arena  *arena = &terminal->read_arena;
+    while (true) {
+        TerminalChar        typed = {0};
+        TerminalInputStatus key = TerminalInput(terminal, input_arena, &typed);
+        if (key == Pending) break;
+        TerminalKeyCount += 1;
+
+        switch (key) {
+            case Char: {
+                String text = {.buffer = typed.bytes, .len = typed.len, .cap = typed.len};
+                StringAppend(line, arena, &text);
+                OutputAppend(&TerminalOutput, typed.bytes, typed.len);
+            } break;
+
+            case Paste: {
+                StringAppend(line, arena, &terminal->paste);
+                OutputAppend(&TerminalOutput, terminal->paste.buffer, terminal->paste.len);
+                StringClear(&terminal->paste);
+            } break;
+
+            case Backspace: {
+                if (line->len == 0) break;
+                u32 at = Utf8PrevCodePoint(line->buffer, line->len);
+                u32 code_point;
+                Utf8Decode(line->buffer + at, line->len - at, &code_point);
+                for (u32 i = 0; i < Utf8Width(code_point); i += 1)
+                    OutputPuts(&TerminalOutput, "\b \b");
+                line->len = at;
+            } break;
+
+            case NewLine: {
+                StringAppendChar(line, arena, '\n');
+                OutputPutc(&TerminalOutput, '\n');
+                TerminalFlush();
+                ExecutorAnswer(executor, line->buffer, line->len);
+                return false;
+            } break;
+
+            case Eof: {
+                if (line->len != 0) break;
+                ExecutorAnswer(executor, "", 0);
+                return false;
+            } break;
+
+            default:
+                break;
+        }
+    }
+    TerminalFlush();
+    if (hung_up) {
+        ExecutorAnswer(executor, line->buffer, line->len);
+        return false;
+    }
+    return true;
+}
+
+/// A cell reads stdin itself: it gets the terminal as the tty driver had it
+/// before the editor, cooked and echoing, and the editor stops reading it
+void TerminalReleaseStdin(Terminal *terminal) {
+    OutputPuts(&TerminalOutput, TERM_PASTE_DISABLE);
+    TerminalFlush();
+    tcsetattr(STDIN_FILENO, TCSANOW, &TerminalOriginalHandle);
+}
+
+void TerminalTakeStdin(Terminal *terminal) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &terminal->handle);
+    OutputPuts(&TerminalOutput, TERM_PASTE_ENABLE);
+    TerminalFlush();
+}
+
+/// Looks for Ctrl-C among the bytes that arrived since `from`. Like the
+/// tty driver does on SIGINT, the keys typed ahead are thrown away with it
+/// (the caller drops what was already pre-edited)
+bool TerminalTakeInterrupt(Terminal *terminal, u32 from) {
+    if (terminal->pasting) return false;
 
-    switch (*c) {
-        case TERM_EOF:
-            return Eof;
+    TerminalInputRing *ring = &terminal->ring;
+    for (u32 offset = from - ring->read; offset < TerminalInputRingLen(ring); offset += 1) {
+        if (TerminalInputRingPeek(ring, offset) != TERM_INTERRUPT) continue;
 
-        // case '\r':
-        case '\n':
-            return NewLine;
+        TerminalInputRingConsume(ring, TerminalInputRingLen(ring));
+        terminal->decoder = (TerminalDecoder){0};
+        return true;
+    }
+    return false;
+}
+
+/// Applies an editing key to the input, everything but submission and EOF
+void TerminalApplyKey(Terminal *terminal, Arena *input_arena, TerminalInputStatus key,
+                      TerminalChar *typed) {
+    // a run of typing or deleting gets undone at once, anything else breaks it
+    UndoRun run = UndoRunNone;
+    if (key == Char) run = UndoRunTyping;
+    if (key == Backspace) run = UndoRunBackspace;
+    if (key == Delete) run = UndoRunDelete;
+    UndoLogBeginStep(&terminal->undo, run);
+
+    switch (key) {
+        case ArrowUp: {
+            if (terminal->pos.row != 0) {
+                TerminalMoveCursorUpBy(terminal, 1);
+            } else if (terminal->history_index != 0 && !(ArrayIsEmpty(&terminal->history))) {
+                TerminalHistoryUp(terminal, input_arena);
+            }
+        } break;
+
+        case ArrowDown: {
+            u32 total_lines = GapBufferLineCount(&terminal->input);
+            if (terminal->pos.row + 1 != total_lines) {
+                TerminalMoveCursorDownBy(terminal, 1);
+            } else if (!(ArrayIsEmpty(&terminal->history)) &&
+                       terminal->history_index + 1 < ArrayLen(&terminal->history)) {
+                TerminalHistoryDown(terminal, input_arena);
+            }
+        } break;
+
+        case ArrowLeft: {
+            TerminalMoveCursorLeft(terminal);
+        } break;
+
+        case ArrowRight: {
+            TerminalMoveCursorRight(terminal);
+        } break;
+
+        case WordLeft: {
+            TerminalMoveCursorWordLeft(terminal);
+        } break;
+
+        case WordRight: {
+            TerminalMoveCursorWordRight(terminal);
+        } break;
+
+        case Home: {
+            terminal->pos.col = 0;
+        } break;
+
+        case End: {
+            terminal->pos.col = GapBufferLineLen(&terminal->input, terminal->pos.row);
+        } break;
+
+        case Delete: {
+            TerminalDeleteCharAtCursor(terminal, input_arena);
+        } break;
+
+        case Backspace:
+            TerminalRemoveCharAtCursor(terminal, input_arena);
+            break;
+
+        case Char: {
+            String text = {.buffer = typed->bytes, .len = typed->len, .cap = typed->len};
+            TerminalInsertStringAtCursor(terminal, input_arena, &text);
+        } break;
+
+        case Paste: {
+            // the buffer is kept for the next paste
+            TerminalInsertStringAtCursor(terminal, input_arena, &terminal->paste);
+            StringClear(&terminal->paste);
+        } break;
+
+        case Undo: {
+            TerminalUndo(terminal, input_arena);
+        } break;
+
+        case Redo: {
+            TerminalRedo(terminal, input_arena);
+        } break;
+
+        default:
             break;
+    }
+}
+
+TerminalInputStatus TerminalInput(Terminal *terminal, Arena *arena, TerminalChar *typed) {
+    if (terminal->pasting) return TerminalInputPaste(terminal, arena);
+
+    TerminalInputRing *ring = &terminal->ring;
+    TerminalDecoder   *decoder = &terminal->decoder;
+    while (TerminalInputRingLen(ring) != 0) {
+        u8 byte = TerminalInputRingPeek(ring, 0);
+        // a sequence cut short, the byte starts whatever comes next
+        if (decoder->state == TerminalDecoderUtf8 && (byte & 0xC0) != 0x80) {
+            decoder->state = TerminalDecoderGround;
+            return 0;
+        }
+        char c = byte;
+        TerminalInputRingConsume(ring, 1);
+        decoder->timed_out = false;
+
+        switch (decoder->state) {
+            case TerminalDecoderGround: {
+                switch (c) {
+                    case TERM_EOF:
+                        return Eof;
+
+                    case TERM_INTERRUPT:
+                        return Interrupt;
+
+                    // case '\r':
+                    case '\n':
+                        return NewLine;
+
+                    case TERM_ESCAPE_CHAR:
+                        decoder->state = TerminalDecoderEscape;
+                        continue;
+
+                    case TERM_DEL:
+                    case TERM_BACKSPACE:
+                        return Backspace;
+
+                    case TERM_UNDO:
+                        return Undo;
+
+                    default: {
+                        if (CharIsPrintable(c)) {
+                            *typed = (TerminalChar){.bytes = {c}, .len = 1};
+                            return Char;
+                        }
+                        // lead bytes of the sequences `Utf8Decode` takes
+                        u32 len = byte >= 0xC2 && byte <= 0xDF   ? 2
+                                  : byte >= 0xE0 && byte <= 0xEF ? 3
+                                  : byte >= 0xF0 && byte <= 0xF4 ? 4
+                                                                 : 0;
+                        if (len == 0) return 0;
+                        decoder->state = TerminalDecoderUtf8;
+                        decoder->utf8 = (TerminalChar){.bytes = {c}, .len = 1};
+                        decoder->utf8_len = len;
+                        continue;
+                    }
+                }
+            } break;
+
+            case TerminalDecoderEscape: {
+                decoder->state = TerminalDecoderGround;
+                switch (c) {
+                    case '[':
+                        *decoder = (TerminalDecoder){.state = TerminalDecoderCsi, .param_count = 1};
+                        continue;
+
+                    case 'O':
+                        decoder->state = TerminalDecoderSs3;
+                        continue;
+
+                    // a lone escape followed by another sequence
+                    case TERM_ESCAPE_CHAR:
+                        decoder->state = TerminalDecoderEscape;
+                        continue;
+
+                    // alt-b and alt-f, as in readline
+                    case 'b':
+                        return WordLeft;
+                    case 'f':
+                        return WordRight;
+                    case '_':
+                        return Redo;
+
+                    // not-interesting keycode
+                    default:
+                        return 0;
+                }
+            } break;
 
-        case TERM_ESCAPE_CHAR: {
-            char buffer[2] = {0};
-            (void)read(STDIN_FILENO, buffer, 2);
-            if (buffer[0] != '[') break; // not-interesting keycode
-            *c = buffer[1];
-            switch (buffer[1]) {
-                // arrow up
-                case 'A':
-                    return ArrowUp;
+            case TerminalDecoderCsi: {
+                if (CharIsDigit(c)) {
+                    u32 *param = &decoder->params[decoder->param_count - 1];
+                    *param = *param * 10 + (c - '0');
+                } else if (c == ';') {
+                    if (decoder->param_count < TERM_CSI_MAX_PARAMS) decoder->param_count += 1;
+                } else if (c >= 0x20 && c <= 0x3F) {
+                    // private markers and intermediates, nothing we handle
+                    decoder->ignored = true;
+                } else if (c >= 0x40 && c <= 0x7E) {
+                    decoder->state = TerminalDecoderGround;
+                    if (decoder->ignored) return 0;
+
+                    TerminalInputStatus status = TerminalDecodeCsi(decoder, c);
+                    if (status != Paste) return status;
+
+                    terminal->pasting = true;
+                    terminal->paste_after_cr = false;
+                    return TerminalInputPaste(terminal, arena);
+                } else if (c == TERM_ESCAPE_CHAR) {
+                    // broken sequence, start over
+                    decoder->state = TerminalDecoderEscape;
+                } else {
+                    decoder->state = TerminalDecoderGround;
+                    return 0;
+                }
+            } break;
 
-                // arrow down
-                case 'B':
-                    return ArrowDown;
+            case TerminalDecoderUtf8: {
+                TerminalChar *utf8 = &decoder->utf8;
+                utf8->bytes[utf8->len++] = c;
+                if (utf8->len < decoder->utf8_len) continue;
 
-                // arrow left
-                case 'D':
-                    return ArrowLeft;
+                decoder->state = TerminalDecoderGround;
+                u32 code_point;
+                if (Utf8Decode(utf8->bytes, utf8->len, &code_point) != utf8->len) return 0;
+                if (Utf8IsControl(code_point)) return 0;
+                *typed = *utf8;
+                return Char;
+            } break;
+
+            case TerminalDecoderSs3: {
+                decoder->state = TerminalDecoderGround;
+                switch (c) {
+                    case 'A':
+                        return ArrowUp;
+                    case 'B':
+                        return ArrowDown;
+                    case 'C':
+                        return ArrowRight;
+                    case 'D':
+                        return ArrowLeft;
+                    case 'H':
+                        return Home;
+                    case 'F':
+                        return End;
+                    default:
+                        return 0;
+                }
+            } break;
+        }
+    }
 
-                // arrow right
-                case 'C':
-                    return ArrowRight;
+    /* nothing followed in time: a lone escape or a truncated sequence */
+    if (decoder->timed_out && decoder->state != TerminalDecoderGround) {
+        *decoder = (TerminalDecoder){0};
+        return 0;
+    }
+    return Pending;
+}
 
+/// Maps a complete CSI sequence to a key, `Paste` stands for the start marker
+TerminalInputStatus TerminalDecodeCsi(TerminalDecoder *decoder, char final) {
+    // xterm encodes modifiers as `1 + bitmask` in the second parameter
+    u32  modifiers = decoder->param_count > 1 && decoder->params[1] ? decoder->params[1] - 1 : 0;
+    bool by_word = modifiers & (TERM_MODIFIER_ALT | TERM_MODIFIER_CTRL);
+
+    switch (final) {
+        case 'A':
+            return ArrowUp;
+        case 'B':
+            return ArrowDown;
+        case 'C':
+            return by_word ? WordRight : ArrowRight;
+        case 'D':
+            return by_word ? WordLeft : ArrowLeft;
+        case 'H':
+            return Home;
+        case 'F':
+            return End;
+
+        // vt220-style keys, `ESC [ <code> ~`
+        case '~': {
+            switch (decoder->params[0]) {
+                case 1:
+                case 7:
+                    return Home;
+                case 4:
+                case 8:
+                    return End;
+                case 3:
+                    return Delete;
+                case 200:
+                    return Paste;
                 default:
                     return 0;
             }
         } break;
 
-        case TERM_DEL:
-        case TERM_BACKSPACE:
-            return Backspace;
-
         default:
+            return 0;
+    }
+}
 
-            if (CharIsPrintable(*c)) {
-                return Char;
+/// Collects the pasted text verbatim till the closing marker.
+/// Carriage returns become new lines, other control bytes are dropped
+TerminalInputStatus TerminalInputPaste(Terminal *terminal, Arena *arena) {
+    TerminalInputRing *ring = &terminal->ring;
+    String            *paste = &terminal->paste;
+    u32                available;
+    while ((available = TerminalInputRingLen(ring)) != 0) {
+        u8 byte = TerminalInputRingPeek(ring, 0);
+        if (byte == TERM_ESCAPE_CHAR) {
+            u32 matched = TerminalInputRingMatch(ring, TERM_PASTE_END, TERM_PASTE_MARKER_LEN);
+            if (matched == TERM_PASTE_MARKER_LEN) {
+                TerminalInputRingConsume(ring, TERM_PASTE_MARKER_LEN);
+                terminal->pasting = false;
+                return Paste;
             }
-            break;
+            /* the marker may be split between two reads */
+            if (matched == available) return Pending;
+            TerminalInputRingConsume(ring, 1);
+            continue;
+        }
+
+        /* copy the run up to the next escape (or the end of the ring) in one go */
+        StringEnsureAdditional(paste, arena, available);
+        for (u32 i = 0; i < available; i += 1) {
+            char c = TerminalInputRingPeek(ring, 0);
+            if (c == TERM_ESCAPE_CHAR) break;
+            TerminalInputRingConsume(ring, 1);
+
+            bool after_cr = terminal->paste_after_cr;
+            terminal->paste_after_cr = c == '\r';
+            if (c == '\r') c = '\n';
+            else if (c == '\n' && after_cr) continue;
+
+            // bytes past ASCII go in as they are, bad UTF-8 shows up as such
+            if (c == '\n' || c == '\t' || CharIsPrintable(c) || (u8)c >= 0x80) {
+                paste->buffer[paste->len] = c;
+                paste->len += 1;
+            }
+        }
     }
+    return Pending;
+}
+
+/// Sleeps until stdin has something to read and pulls it into the ring.
+/// A partial escape sequence is only waited on for `TERM_ESCAPE_TIMEOUT_MS`,
+/// a held back frame until it's due. Returns false once stdin is gone
+bool TerminalWaitInput(Terminal *terminal) {
+    bool in_sequence = !terminal->pasting && terminal->decoder.state != TerminalDecoderGround;
+    i32  timeout = in_sequence ? TERM_ESCAPE_TIMEOUT_MS : -1;
+
+    // a held back frame goes out once it's due, keys or not
+    i32  frame_wait = TerminalFrameWaitMs(terminal);
+    bool frame_first = frame_wait >= 0 && (timeout < 0 || frame_wait < timeout);
+    if (frame_first) timeout = frame_wait;
+    while (true) {
+        if (EventLoopWait(&terminal->events, timeout) == 0) {
+            if (!frame_first) terminal->decoder.timed_out = true;
+            return true;
+        }
+        if (EventLoopIsReadable(&terminal->events, terminal->resize_source)) {
+            TerminalHandleResize(terminal);
+            return true;
+        }
+        if (EventLoopIsReadable(&terminal->events, terminal->input_source)) {
+            if (terminal->executor) ExecutorYieldInput(terminal->executor);
+            if (TerminalFillInput(terminal)) return true;
+        }
+        if (EventLoopIsHangUp(&terminal->events, terminal->input_source)) return false;
+    }
+}
+
+/// Reads as many bytes as the ring can take with a single syscall
+bool TerminalFillInput(Terminal *terminal) {
+    TerminalInputRing *ring = &terminal->ring;
+    u32                free = TERM_INPUT_RING_CAP - TerminalInputRingLen(ring);
+    if (free == 0) return true;
+
+    u32 start = ring->write & TERM_INPUT_RING_MASK;
+    u32 head_len = TERM_INPUT_RING_CAP - start;
+    if (head_len > free) head_len = free;
+
+    struct iovec chunks[2] = {
+        {.iov_base = ring->buffer + start, .iov_len = head_len},
+        {.iov_base = ring->buffer, .iov_len = free - head_len},
+    };
+    ssize_t num_read = readv(STDIN_FILENO, chunks, chunks[1].iov_len ? 2 : 1);
+    if (num_read <= 0) return false;
 
-    return 0;
+    ring->write += num_read;
+    return true;
+}
+
+u32 TerminalInputRingLen(TerminalInputRing *ring) { return ring->write - ring->read; }
+
+u8 TerminalInputRingPeek(TerminalInputRing *ring, u32 offset) {
+    assert(offset < TerminalInputRingLen(ring));
+    return ring->buffer[(ring->read + offset) & TERM_INPUT_RING_MASK];
+}
+
+void TerminalInputRingConsume(TerminalInputRing *ring, u32 count) {
+    assert(count <= TerminalInputRingLen(ring));
+    ring->read += count;
+}
+
+/// Returns how many leading bytes of the ring match `sequence`
+u32 TerminalInputRingMatch(TerminalInputRing *ring, char *sequence, u32 len) {
+    u32 available = TerminalInputRingLen(ring);
+    u32 matched = 0;
+    while (matched < len && matched < available &&
+           TerminalInputRingPeek(ring, matched) == (u8)sequence[matched]) {
+        matched += 1;
+    }
+    return matched;
 }
 
 void TerminalStartNewLine(Terminal *terminal, Arena *arena) {
-    fputs(TERM_PROMPT_NEW, stdout);
-    fflush(stdout);
+    /* keys typed while the previous cell ran are already in the input */
+    TerminalRender(terminal);
+    TerminalFlush();
 }
 
 void TerminalHistoryAdd(Terminal *terminal, Arena *history_arena) {
-    String copy = StringCopy(&terminal->input, history_arena);
+    String copy = GapBufferCopy(&terminal->input, history_arena);
     ArrayPush(&terminal->history, history_arena, copy);
     terminal->history_index = ArrayLen(&terminal->history);
 }
 
-void TerminalInsertCharAtCursor(Terminal *terminal, Arena *arena, char c) {
-    assert(isalnum(c) || isspace(c) || ispunct(c));
-    u32 line_offset =
-        StringSearchNthAddOne(&terminal->input, terminal->pos.row, '\n') + terminal->pos.col;
-    String current_line = TerminalGetCursorLine(terminal);
-
-    StringInsertChar(&terminal->input, arena, line_offset, c);
-
-    if (c != '\n') terminal->pos.col += 1;
-    TerminalReRenderCursorLine(terminal);
-    if (c == '\n') {
-        u32 indentation_level = StringIndentationLevel(&current_line);
-        if (line_offset != 0 && StringGetChar(&terminal->input, line_offset - 1) == ':') {
-            indentation_level += 1;
-        }
-        StringInsertIndentation(&terminal->input, arena, line_offset + 1, indentation_level);
+/// Breaks the line at the cursor, the new one indented to go on with the code
+void TerminalInsertNewLine(Terminal *terminal, Arena *arena) {
+    u32    cursor = GapBufferLineStart(&terminal->input, terminal->pos.row) + terminal->pos.col;
+    String newline = {.buffer = "\n", .len = 1};
+    TerminalEditSpan(terminal, arena, cursor, 0, &newline, true);
+}
 
-        TerminalReRenderLinesBelowCursor(terminal);
-        terminal->pos.row += 1;
-        terminal->pos.col = indentation_level * 4;
-        printf("\n");
-        TerminalEnsureColumnPosition(terminal);
-    }
+/// Inserts `text` at the cursor as is, without auto-indentation
+void TerminalInsertStringAtCursor(Terminal *terminal, Arena *arena, String *text) {
+    if (StringIsEmpty(text)) return;
+    u32 cursor = GapBufferLineStart(&terminal->input, terminal->pos.row) + terminal->pos.col;
+    TerminalEditSpan(terminal, arena, cursor, 0, text, false);
 }
 
+/// Removes the code point before the cursor, joining lines at the start of one
 void TerminalRemoveCharAtCursor(Terminal *terminal, Arena *arena) {
     /* if the multiline is empty -- there is nothing to delete */
-    if (StringIsEmpty(&terminal->input) || (terminal->pos.row == 0 && terminal->pos.col == 0))
+    if (GapBufferLen(&terminal->input) == 0 || (terminal->pos.row == 0 && terminal->pos.col == 0))
         return;
 
-    u32 line_start = StringSearchNthAddOne(&terminal->input, terminal->pos.row, '\n');
-    StringRemoveChar(&terminal->input, line_start + terminal->pos.col - 1);
+    u32 line_start = GapBufferLineStart(&terminal->input, terminal->pos.row);
+    u32 cursor = line_start + terminal->pos.col;
+    u32 len = 1;
+    if (terminal->pos.col != 0) {
+        // a mark goes on its own, the letter under it stays
+        String before = GapBufferSlice(&terminal->input, line_start, cursor);
+        len = before.len - Utf8PrevCodePoint(before.buffer, before.len);
+    }
+    TerminalEditSpan(terminal, arena, cursor - len, len, &(String){0}, false);
+}
 
-    if (terminal->pos.col == 0) {
-        u32 prev_line_start = StringSearchNthAddOne(&terminal->input, terminal->pos.row - 1, '\n');
-        terminal->pos.col = line_start - prev_line_start - 1;
-        TerminalMoveCursorUpBy(terminal, 1);
-        /* clear from cursor to the end of the screen */
-        printf("\r\x1b[0J");
-        TerminalReRenderCursorLine(terminal);
-        TerminalReRenderLinesBelowCursor(terminal);
+/// Removes the grapheme under the cursor, joining lines at the end of one
+void TerminalDeleteCharAtCursor(Terminal *terminal, Arena *arena) {
+    u32 line_len = GapBufferLineLen(&terminal->input, terminal->pos.row);
+    u32 line_start = GapBufferLineStart(&terminal->input, terminal->pos.row);
+    u32 offset = line_start + terminal->pos.col;
+    if (offset >= GapBufferLen(&terminal->input)) return;
+
+    // the newline at the end of the line
+    u32 len = 1;
+    if (terminal->pos.col != line_len) {
+        String rest = GapBufferSlice(&terminal->input, offset, line_start + line_len);
+        u32    width;
+        len = Utf8NextGrapheme(rest.buffer, rest.len, 0, &width);
+    }
+    TerminalEditSpan(terminal, arena, offset, len, &(String){0}, false);
+}
+
+/// Swaps [offset, offset + len) of the input for `text` and keeps the screen
+/// up with it, however many lines either spans. Returns the lines to repaint,
+/// the ones below them only moved by its `shift`
+TerminalDamage TerminalReplaceAt(Terminal *terminal, Arena *arena, u32 offset, u32 len,
+                                 char *text, u32 text_len) {
+    GapBuffer *input = &terminal->input;
+    u32        row = GapBufferLineOf(input, offset);
+    u32        col = offset - GapBufferLineStart(input, row);
+    u32        removed_lines = GapBufferLineOf(input, offset + len) - row;
+    GapBufferReplace(input, arena, offset, len, text, text_len);
+    u32 added_lines = GapBufferLineOf(input, offset + text_len) - row;
+
+    i32 shift = (i32)added_lines - (i32)removed_lines;
+    if (removed_lines == 0 && added_lines == 0) {
+        if (len) TerminalEditLine(terminal, row, col, -(i32)len);
+        if (text_len) TerminalEditLine(terminal, row, col, text_len);
     } else {
-        terminal->pos.col -= 1;
-        TerminalReRenderCursorLine(terminal);
+        TerminalShiftLines(terminal, row, shift);
     }
+    TerminalDamageLines(terminal, row, row + added_lines);
+    return (TerminalDamage){.first = row, .last = row + added_lines, .shift = shift};
 }
 
-void TerminalMoveCursorUpBy(Terminal *terminal, u32 by) {
-    if (terminal->pos.row == 0) return;
+/// Replaces [offset, offset + len) of the input with `text` as a single edit,
+/// the cursor ends up after it. With `indent` the lines of `text` after the
+/// first get indented like typed ones, all in one pass. Returns the lines to
+/// repaint
+TerminalDamage TerminalEditSpan(Terminal *terminal, Arena *arena, u32 offset, u32 len,
+                                String *text, bool indent) {
+    GapBuffer *input = &terminal->input;
+    u32        cursor = GapBufferLineStart(input, terminal->pos.row) + terminal->pos.col;
+    ArenaScope scope = ArenaMark(&terminal->scratch);
+    String     indented;
+    if (indent) {
+        u32    line_start = GapBufferLineStart(input, GapBufferLineOf(input, offset));
+        String before = GapBufferSlice(input, line_start, offset);
+        indented = StringIndentLines(text, &terminal->scratch, &before);
+        text = &indented;
+    }
 
-    String prev_line = StringNthLine(&terminal->input, terminal->pos.row - 1);
-    u32    col = terminal->pos.col;
-    if (col > prev_line.len) col = prev_line.len;
-    terminal->pos.row -= 1;
-    terminal->pos.col = col;
+    String old = GapBufferSlice(input, offset, offset + len);
+    UndoLogRecord(&terminal->undo, UndoRemove, offset, old.buffer, old.len, cursor);
+    UndoLogRecord(&terminal->undo, UndoInsert, offset, text->buffer, text->len, cursor);
+    TerminalDamage damage =
+        TerminalReplaceAt(terminal, arena, offset, len, text->buffer, text->len);
+    TerminalMoveCursorTo(terminal, offset + text->len);
+    ArenaRewind(&terminal->scratch, scope);
+    return damage;
+}
 
-    for (u32 i = 0; i < by; i++)
-        printf(TERM_ESCAPE "[1F");
-    TerminalEnsureColumnPosition(terminal);
+/// Swaps the whole input for `text`, undoable like any other edit. Only the
+/// lines that differ get replaced, the ones around them stay on the screen
+void TerminalReplaceInput(Terminal *terminal, Arena *arena, String *text) {
+    GapBuffer *input = &terminal->input;
+    String     old = GapBufferSlice(input, 0, GapBufferLen(input));
+    u32        common = old.len < text->len ? old.len : text->len;
+
+    // whole lines in common at the start, then at the end
+    u32 prefix = 0;
+    while (prefix < common && old.buffer[prefix] == text->buffer[prefix])
+        prefix += 1;
+    while (prefix > 0 && old.buffer[prefix - 1] != '\n')
+        prefix -= 1;
+    u32 suffix = 0;
+    while (suffix < common - prefix &&
+           old.buffer[old.len - suffix - 1] == text->buffer[text->len - suffix - 1])
+        suffix += 1;
+    while (suffix > 0 && old.buffer[old.len - suffix] != '\n')
+        suffix -= 1;
+
+    String middle = StringSliceFromTo(text, prefix, text->len - suffix);
+    TerminalEditSpan(terminal, arena, prefix, old.len - suffix - prefix, &middle, false);
+}
+
+/// Reverts the last step of edits, the cursor goes back where it was before
+/// it. Costs as much as the step did, no matter how big the input is
+void TerminalUndo(Terminal *terminal, Arena *arena) {
+    UndoOp *op;
+    while ((op = UndoLogBack(&terminal->undo))) {
+        if (op->kind == UndoInsert) {
+            TerminalReplaceAt(terminal, arena, op->offset, op->len, NULL, 0);
+        } else {
+            TerminalReplaceAt(terminal, arena, op->offset, 0, UndoOpText(op), op->len);
+        }
+        if (op->starts_step) {
+            TerminalMoveCursorTo(terminal, op->cursor);
+            return;
+        }
+    }
+}
+
+/// Makes the last undone step again, the cursor ends up after it
+void TerminalRedo(Terminal *terminal, Arena *arena) {
+    UndoOp *op;
+    for (bool first = true; (op = UndoLogForward(&terminal->undo, first)); first = false) {
+        if (op->kind == UndoInsert) {
+            TerminalReplaceAt(terminal, arena, op->offset, 0, UndoOpText(op), op->len);
+            TerminalMoveCursorTo(terminal, op->offset + op->len);
+        } else {
+            TerminalReplaceAt(terminal, arena, op->offset, op->len, NULL, 0);
+            TerminalMoveCursorTo(terminal, op->offset);
+        }
+    }
+}
+
+/// Puts the cursor on the `offset`th char of the input
+void TerminalMoveCursorTo(Terminal *terminal, u32 offset) {
+    terminal->pos.row = GapBufferLineOf(&terminal->input, offset);
+    terminal->pos.col = offset - GapBufferLineStart(&terminal->input, terminal->pos.row);
+}
+
+/// Goes up keeping the column on the screen, as far as the line above allows
+void TerminalMoveCursorUpBy(Terminal *terminal, u32 by) {
+    if (terminal->pos.row < by) by = terminal->pos.row;
+    if (by == 0) return;
+
+    u32 column = TerminalCursorColumn(terminal);
+    terminal->pos.row -= by;
+    terminal->pos.col = TerminalColumnOffset(terminal, terminal->pos.row, column);
 }
 
 void TerminalMoveCursorDownBy(Terminal *terminal, u32 by) {
-    u32 total_lines = StringCount(&terminal->input, '\n');
+    u32 total_lines = GapBufferLineCount(&terminal->input) - 1;
     if (terminal->pos.row + by <= total_lines) {
-        String next_line = StringNthLine(&terminal->input, terminal->pos.row + by);
-        u32    col = terminal->pos.col;
-        if (col > next_line.len) col = next_line.len;
+        u32 column = TerminalCursorColumn(terminal);
         terminal->pos.row += by;
-        terminal->pos.col = col;
-        for (u32 i = 0; i < by; i++)
-            printf("\n");
-        TerminalEnsureColumnPosition(terminal);
+        terminal->pos.col = TerminalColumnOffset(terminal, terminal->pos.row, column);
     } else {
         // move cursor to the end of line
-        String current_line = TerminalGetCursorLine(terminal);
-        terminal->pos.col = current_line.len;
-        TerminalEnsureColumnPosition(terminal);
+        terminal->pos.col = GapBufferLineLen(&terminal->input, terminal->pos.row);
     }
 }
 
@@ -388,175 +1466,634 @@ void TerminalHistoryUp(Terminal *terminal, Arena *input_arena) {
     String history_input = ArrayGetNth(&terminal->history, terminal->history_index - 1);
     String trimmed = StringRightTrim(&history_input);
 
-    terminal->input = StringCopy(&trimmed, input_arena);
+    TerminalReplaceInput(terminal, input_arena, &trimmed);
     terminal->history_index -= 1;
 
-    TerminalMoveCursorUpBy(terminal, terminal->pos.row);
-    terminal->pos.col = 0;
-    TerminalRender(terminal);
-
-    u32 line_count = StringCount(&terminal->input, '\n');
-    TerminalMoveCursorDownBy(terminal, line_count);
-
-    String last_line = TerminalGetCursorLine(terminal);
-    terminal->pos.col = last_line.len;
-
-    TerminalEnsureColumnPosition(terminal);
+    terminal->pos.row = GapBufferLineCount(&terminal->input) - 1;
+    terminal->pos.col = GapBufferLineLen(&terminal->input, terminal->pos.row);
 }
 
 void TerminalHistoryDown(Terminal *terminal, Arena *input_arena) {
     if (ArrayIsEmpty(&terminal->history) ||
-        terminal->history_index + 1 == ArrayLen(&terminal->history)) {
+        terminal->history_index + 1 >= ArrayLen(&terminal->history)) {
         return;
     }
     String nth_history_input = ArrayGetNth(&terminal->history, terminal->history_index + 1);
     String trimmed = StringRightTrim(&nth_history_input);
-    terminal->input = StringCopy(&trimmed, input_arena);
+    TerminalReplaceInput(terminal, input_arena, &trimmed);
     terminal->history_index += 1;
 
-    TerminalMoveCursorUpBy(terminal, terminal->pos.row);
-    terminal->pos.col = 0;
-    TerminalRender(terminal);
-
-    u32 line_count = StringCount(&terminal->input, '\n');
-    TerminalMoveCursorDownBy(terminal, line_count);
-
-    String last_line = TerminalGetCursorLine(terminal);
-    terminal->pos.col = last_line.len;
-
-    TerminalEnsureColumnPosition(terminal);
+    terminal->pos.row = GapBufferLineCount(&terminal->input) - 1;
+    terminal->pos.col = GapBufferLineLen(&terminal->input, terminal->pos.row);
 }
 
+/// Steps over a whole grapheme, wrapping to the end of the line above
 void TerminalMoveCursorLeft(Terminal *terminal) {
     if (terminal->pos.col > 0) {
-        putc('\b', stdout);
-        terminal->pos.col -= 1;
+        u32    start = GapBufferLineStart(&terminal->input, terminal->pos.row);
+        String before = GapBufferSlice(&terminal->input, start, start + terminal->pos.col);
+        terminal->pos.col = Utf8PrevGrapheme(before.buffer, before.len);
     } else if (terminal->pos.row != 0) {
         TerminalMoveCursorUpBy(terminal, 1);
-        terminal->pos.col = TerminalGetCursorLine(terminal).len;
-        TerminalEnsureColumnPosition(terminal);
+        terminal->pos.col = GapBufferLineLen(&terminal->input, terminal->pos.row);
     }
 }
 
 void TerminalMoveCursorRight(Terminal *terminal) {
-    String current_line = TerminalGetCursorLine(terminal);
-    u32    next_position = terminal->pos.col + 1;
-    if (next_position <= current_line.len) {
-        printf("\x1b[C");
-        terminal->pos.col = next_position;
+    u32 start = GapBufferLineStart(&terminal->input, terminal->pos.row);
+    u32 line_len = GapBufferLineLen(&terminal->input, terminal->pos.row);
+    if (terminal->pos.col >= line_len) return;
+
+    String after = GapBufferSlice(&terminal->input, start + terminal->pos.col, start + line_len);
+    u32    width;
+    terminal->pos.col += Utf8NextGrapheme(after.buffer, after.len, 0, &width);
+}
+
+/// Jumps to the start of the previous word, wrapping to the line above
+void TerminalMoveCursorWordLeft(Terminal *terminal) {
+    if (terminal->pos.col == 0) {
+        TerminalMoveCursorLeft(terminal);
+        return;
     }
+    GapBuffer *input = &terminal->input;
+    u32        start = GapBufferLineStart(input, terminal->pos.row);
+    u32        col = terminal->pos.col;
+    while (col > 0 && !CharIsIdent(GapBufferGetChar(input, start + col - 1)))
+        col -= 1;
+    while (col > 0 && CharIsIdent(GapBufferGetChar(input, start + col - 1)))
+        col -= 1;
+    terminal->pos.col = col;
 }
 
+/// Jumps past the end of the next word, wrapping to the line below
+void TerminalMoveCursorWordRight(Terminal *terminal) {
+    GapBuffer *input = &terminal->input;
+    u32        start = GapBufferLineStart(input, terminal->pos.row);
+    u32        line_len = GapBufferLineLen(input, terminal->pos.row);
+    u32        col = terminal->pos.col;
+    if (col == line_len) {
+        u32 total_lines = GapBufferLineCount(&terminal->input);
+        if (terminal->pos.row + 1 == total_lines) return;
+        terminal->pos.row += 1;
+        terminal->pos.col = 0;
+        return;
+    }
+    while (col < line_len && !CharIsIdent(GapBufferGetChar(input, start + col)))
+        col += 1;
+    while (col < line_len && CharIsIdent(GapBufferGetChar(input, start + col)))
+        col += 1;
+    terminal->pos.col = col;
+}
+
+/// Moves the terminal's cursor to `pos`, which has to be in the viewport
 void TerminalEnsureColumnPosition(Terminal *terminal) {
-    String current_line = TerminalGetCursorLine(terminal);
-    assert(terminal->pos.col <= current_line.len);
-    printf("%s[%uG", TERM_ESCAPE, terminal->pos.col + 5);
-    TerminalFlush();
+    assert(terminal->pos.col <= GapBufferLineLen(&terminal->input, terminal->pos.row));
+    assert(terminal->pos.row >= terminal->top && "cursor above the viewport");
+    u32            column = TerminalCursorColumn(terminal);
+    TerminalWindow window = TerminalLineWindow(terminal, terminal->columns.width, terminal->left);
+    ScreenMoveTo(&terminal->screen, &TerminalOutput, terminal->pos.row - terminal->top,
+                 TERM_PROMPT_LEN + window.clipped_left + column - window.left);
+}
+
+/// Column of the cursor within its line, leaves the columns map on that line
+u32 TerminalCursorColumn(Terminal *terminal) {
+    String       line = TerminalCursorLineView(terminal);
+    Utf8Columns *columns = TerminalColumns(terminal, terminal->pos.row, &line);
+    return Utf8ColumnsOf(columns, &line, terminal->pos.col);
+}
+
+/// Offset within line `row` of the grapheme at `column`, or of the one that
+/// covers it. The line's end if it's narrower than that
+u32 TerminalColumnOffset(Terminal *terminal, u32 row, u32 column) {
+    String       line = GapBufferNthLine(&terminal->input, row);
+    Utf8Columns *columns = TerminalColumns(terminal, row, &line);
+    return Utf8ColumnsOffset(columns, &line, column, NULL);
 }
 
 String TerminalGetCursorLine(Terminal *terminal) {
-    return StringNthLine(&terminal->input, terminal->pos.row);
+    return GapBufferNthLine(&terminal->input, terminal->pos.row);
+}
+
+/// The cursor line as far as a frame reads it: from where its columns and
+/// lexer resume after the edits, and from the checkpoints before the window,
+/// which starts at most a screen left of the cursor. The bytes before that
+/// aren't in place, so typing into a long line leaves the gap at the cursor
+String TerminalCursorLineView(Terminal *terminal) {
+    u32          from = 0;
+    Utf8Columns *columns = &terminal->columns;
+    if (terminal->columns_line == terminal->pos.row) {
+        // a checkpoint the edits left alone, at or before the cursor
+        u32 at = Utf8ColumnsResume(columns);
+        while (at > 0 && columns->buffer[at].offset > terminal->pos.col)
+            at -= 1;
+        u32 column = columns->buffer[at].column;
+        u32 left = column > terminal->width ? column - terminal->width : 0;
+        while (at > 0 && columns->buffer[at].column > left)
+            at -= 1;
+        from = columns->buffer[at].offset;
+    }
+    TokenizerCheckpoints *checkpoints = &terminal->checkpoints;
+    if (from > 0 && terminal->checkpoint_line == terminal->pos.row) {
+        u32 at = TokenizerCheckpointsResume(checkpoints);
+        while (at > 0 && checkpoints->buffer[at].offset > from)
+            at -= 1;
+        from = checkpoints->buffer[at].offset;
+    }
+    // whether a break is stable depends on the code point before it
+    from = from > 4 ? from - 4 : 0;
+    return GapBufferLineFrom(&terminal->input, terminal->pos.row, from);
 }
 
 String TerminalGetPreviousLine(Terminal *terminal) {
     assert(terminal->pos.row > 0);
 
-    return StringNthLine(&terminal->input, terminal->pos.row - 1);
+    return GapBufferNthLine(&terminal->input, terminal->pos.row - 1);
 }
 
-void TerminalEraseUntilEnd(void) { printf("%s", TERM_ERASE_UNTIL_END); }
+void TerminalEraseUntilEnd(void) { OutputPuts(&TerminalOutput, TERM_ERASE_UNTIL_END); }
 
-void TerminalClearLine(void) { printf("%s\r", TERM_CLEAR_LINE); }
+void TerminalClearLine(void) { OutputPrintf(&TerminalOutput, "%s\r", TERM_CLEAR_LINE); }
 
-void TerminalSavePosition(void) { printf("%s", TERM_SAVE_POSITION); }
+void TerminalSavePosition(void) { OutputPuts(&TerminalOutput, TERM_SAVE_POSITION); }
 
-void TerminalRestorePosition(void) { printf("%s", TERM_RESTORE_POSITION); }
+void TerminalRestorePosition(void) { OutputPuts(&TerminalOutput, TERM_RESTORE_POSITION); }
 
-void TerminalEnableWrapping(void) { printf("%s", TERM_LINE_WRAPPING); }
+void TerminalEnableWrapping(void) { OutputPuts(&TerminalOutput, TERM_LINE_WRAPPING); }
+
+/// Abandons the input after Ctrl-C. It stays on the screen,
+/// marked with `^C`, and the cursor ends up below it
+void TerminalDiscardInput(Terminal *terminal) {
+    u32 last_row = GapBufferLineCount(&terminal->input) - 1;
+    u32 last_len = GapBufferLineLen(&terminal->input, last_row);
+    terminal->pos = (TerminalPosition){.row = last_row, .col = last_len};
+    TerminalRefresh(terminal);
+    OutputPuts(&TerminalOutput, "^C\n");
+    TerminalResetInput(terminal);
+}
 
 void TerminalResetInput(Terminal *terminal) {
-    StringReset(&terminal->input);
+    GapBufferReset(&terminal->input);
+    UndoLogClear(&terminal->undo);
     terminal->pos = (TerminalPosition){0};
+    terminal->top = 0;
+    terminal->left = 0;
+    terminal->checkpoint_line = TERM_NO_LINE;
+    terminal->columns_line = TERM_NO_LINE;
+    terminal->paste = (String){0};
+    ScreenReset(&terminal->screen);
+    ArenaReset(&terminal->lex_arena);
+    terminal->line_states = (TerminalLineStates){0};
+    terminal->damage = (TerminalDamage){.first = TERM_DAMAGE_TO_END, .last = 0};
 }
 
-void TerminalFlush(void) { fflush(stdout); }
+void TerminalFlush(void) { OutputFlush(&TerminalOutput); }
 
-void TerminalRender(Terminal *terminal) {
-    if (terminal->pos.row) {
-        printf("%s[%uA\r", TERM_ESCAPE, terminal->pos.row);
+/// Marks lines [first, last] to be repainted on the next refresh
+void TerminalDamageLines(Terminal *terminal, u32 first, u32 last) {
+    if (first < terminal->damage.first) terminal->damage.first = first;
+    if (last > terminal->damage.last) terminal->damage.last = last;
+    // the input got replaced, the checkpoints are of some other line
+    if (last == TERM_DAMAGE_TO_END) {
+        terminal->checkpoint_line = TERM_NO_LINE;
+        terminal->columns_line = TERM_NO_LINE;
     }
-    printf("%s", TERM_ERASE_UNTIL_END);
+}
 
-    u32 line_count = StringCount(&terminal->input, '\n') + 1;
-    u32 start = 0;
-    for (u32 line_idx = 0; line_idx < line_count; line_idx += 1) {
-        u32    end = StringSearchNth(&terminal->input, line_idx + 1, '\n');
-        String current_line = StringSliceFromTo(&terminal->input, start, end);
-        TerminalPrintLineHighlighted(terminal, &current_line, line_idx);
-        printf("\n");
-        // char  *prompt = line_idx == 0 ? TERM_PROMPT_NEW : TERM_PROMPT_CONTINUE;
-        // printf("%s\r%s%.*s\n", TERM_ERASE_ENTIRE_LINE, prompt, current_line.len,
-        //        current_line.buffer);
-        start = end + 1;
+/// Keeps the lexer checkpoints and the columns of `row` in step with an edit
+/// within the line at `col`: `delta` bytes inserted, or `-delta` removed
+void TerminalEditLine(Terminal *terminal, u32 row, u32 col, i32 delta) {
+    if (row == terminal->columns_line) {
+        if (delta > 0) {
+            Utf8ColumnsInsert(&terminal->columns, col, delta);
+        } else {
+            Utf8ColumnsRemove(&terminal->columns, col, -delta);
+        }
+    }
+    if (row != terminal->checkpoint_line) return;
+    if (delta > 0) {
+        TokenizerCheckpointsInsert(&terminal->checkpoints, col, delta);
+    } else {
+        TokenizerCheckpointsRemove(&terminal->checkpoints, col, -delta);
     }
+}
 
-    printf("\x1b[%uF", line_count - terminal->pos.row);
-    TerminalEnsureColumnPosition(terminal);
+/// Columns of line `row`, whose text is `line`. Only one line has them at a
+/// time, picking another one scans it from the start
+Utf8Columns *TerminalColumns(Terminal *terminal, u32 row, String *line) {
+    if (terminal->columns_line != row) {
+        Utf8ColumnsReset(&terminal->columns);
+        terminal->columns_line = row;
+    }
+    Utf8ColumnsUpdate(&terminal->columns, line);
+    return &terminal->columns;
 }
 
-void TerminalPrintLineHighlighted(Terminal *terminal, String *line, u32 line_idx) {
-    Token     t = {0};
-    Tokenizer tokenizer = {.input = *line};
-    printf("%s\r%s", TERM_ERASE_ENTIRE_LINE,
-           line_idx == 0 ? TERM_PROMPT_NEW : TERM_PROMPT_CONTINUE);
-    while ((t = TokenizerNext(&tokenizer)).type) {
-        switch (t.type) {
-            case TokenTypeConstantTrue:
-            case TokenTypeConstantFalse:
-            case TokenTypeConstantNone:
-            case TokenTypeNumber: {
-                printf("\x1b[94m%.*s\x1b[0m", t.s.len, t.s.buffer);
-            } break;
+/// Lines after `at` moved by `delta`: either `delta` new lines follow it, or the
+/// `-delta` lines that followed it are gone. Lexer states move along, and the
+/// damage keeps track of the shift so the screen rows below can be reused
+void TerminalShiftLines(Terminal *terminal, u32 at, i32 delta) {
+    TerminalDamage *damage = &terminal->damage;
+    if (damage->first <= damage->last && damage->last != TERM_DAMAGE_TO_END) {
+        damage->first = TerminalShiftLine(damage->first, at, delta);
+        damage->last = TerminalShiftLine(damage->last, at, delta);
+    }
+    damage->shift += delta;
 
-            case TokenTypeComment: {
-                printf("\x1b[90m%.*s\x1b[0m", t.s.len, t.s.buffer);
-            } break;
+    terminal->left_row = TerminalShiftLine(terminal->left_row, at, delta);
+    if (terminal->checkpoint_line != TERM_NO_LINE && terminal->checkpoint_line >= at) {
+        terminal->checkpoint_line = TERM_NO_LINE;
+    }
+    if (terminal->columns_line != TERM_NO_LINE && terminal->columns_line >= at) {
+        terminal->columns_line = TERM_NO_LINE;
+    }
 
-            case TokenTypeString: {
-                printf("\x1b[91m%.*s\x1b[0m", t.s.len, t.s.buffer);
-            } break;
+    TerminalLineStates *states = &terminal->line_states;
+    if (at >= ArrayLen(states)) return;
 
-            default: {
-                if (TokenTypeIsKeyword(t.type)) {
-                    printf("\x1b[1;33m%.*s\x1b[0m", t.s.len, t.s.buffer);
-                } else if (TokenTypeIsPunct(t.type)) {
-                    printf("\x1b[90m%.*s\x1b[0m", t.s.len, t.s.buffer);
-                } else {
-                    printf("%.*s", t.s.len, t.s.buffer);
-                }
-            } break;
+    u32 tail = ArrayLen(states) - at - 1;
+    if (delta > 0) {
+        u32 added = delta;
+        ArrayEnsureAdditionalCap(states, &terminal->lex_arena, added);
+        memmove(&states->buffer[at + 1 + added], &states->buffer[at + 1],
+                tail * sizeof(TokenizerState));
+        states->header.len += added;
+    } else {
+        u32 removed = -delta;
+        if (removed > tail) removed = tail;
+        memmove(&states->buffer[at + 1], &states->buffer[at + 1 + removed],
+                (tail - removed) * sizeof(TokenizerState));
+        states->header.len -= removed;
+    }
+}
+
+/// Where `line` ends up after `TerminalShiftLines`
+u32 TerminalShiftLine(u32 line, u32 at, i32 delta) {
+    if (line <= at) return line;
+    if (delta >= 0) return line + delta;
+    return line - at > (u32)-delta ? line + delta : at;
+}
+
+/// Makes room for a state per line. States of new lines are garbage until
+/// lexed, which they will be: line count only changes along with damage
+void TerminalSyncLineStates(Terminal *terminal) {
+    TerminalLineStates *states = &terminal->line_states;
+    u32                 line_count = GapBufferLineCount(&terminal->input);
+    if (line_count > ArrayLen(states)) {
+        ArrayEnsureAdditionalCap(states, &terminal->lex_arena, line_count - ArrayLen(states));
+    }
+    states->header.len = line_count;
+    states->buffer[0] = (TokenizerState){0};
+}
+
+/// Lexer state at the start of line `row`, without waiting for a frame. The
+/// stored states hold up to the first damaged line, the ones from there to
+/// `row` get lexed and stored. Lines whose start state changed are damaged,
+/// so the next frame still repaints them
+TokenizerState TerminalLineState(Terminal *terminal, u32 row) {
+    TerminalSyncLineStates(terminal);
+    TerminalLineStates *states = &terminal->line_states;
+    u32                 first = terminal->damage.first < row ? terminal->damage.first : row;
+    for (u32 line_idx = first; line_idx < row; line_idx += 1) {
+        String         line = GapBufferNthLine(&terminal->input, line_idx);
+        TokenizerState state = TokenizerEndState(&line, states->buffer[line_idx]);
+        if (!TokenizerStateEqual(states->buffer[line_idx + 1], state)) {
+            states->buffer[line_idx + 1] = state;
+            TerminalDamageLines(terminal, line_idx + 1, line_idx + 1);
         }
     }
+    return states->buffer[row];
+}
+
+/// Whether the keys applied so far should be painted now. They are, unless
+/// the previous frame went out less than `frame_interval_ms` ago
+bool TerminalFrameDue(Terminal *terminal) {
+    return TerminalFrameWaitMs(terminal) == 0;
+}
+
+/// How long until the pending frame is due, -1 if there is none
+i32 TerminalFrameWaitMs(Terminal *terminal) {
+    if (!terminal->frame_pending) return -1;
+    u64 since = EventLoopNowMs() - terminal->frame_at_ms;
+    return since >= terminal->frame_interval_ms ? 0 : terminal->frame_interval_ms - since;
+}
+
+/// Paints everything edited since the previous refresh and places the cursor
+void TerminalRefresh(Terminal *terminal) {
+    u32 line_count = GapBufferLineCount(&terminal->input);
+    TerminalRenderFrame(terminal, line_count);
     TerminalEnsureColumnPosition(terminal);
 }
 
-void TerminalReRenderCursorLine(Terminal *terminal) {
-    String cursor_line = TerminalGetCursorLine(terminal);
-    TerminalPrintLineHighlighted(terminal, &cursor_line, terminal->pos.row);
+/// Paints the submitted input without its trailing (empty) line
+/// and leaves the cursor at the start of a fresh line below it
+void TerminalRefreshSubmitted(Terminal *terminal) {
+    TerminalRenderFrame(terminal, terminal->pos.row);
+    ScreenMoveTo(&terminal->screen, &TerminalOutput, terminal->pos.row - terminal->top, 0);
+    OutputPrintf(&TerminalOutput, "\r%s", TERM_ERASE_UNTIL_END);
+}
+
+void TerminalRender(Terminal *terminal) {
+    TerminalDamageLines(terminal, 0, TERM_DAMAGE_TO_END);
+    TerminalRefresh(terminal);
+}
+
+/// Lays out the first `line_count` lines that fall into the viewport into
+/// the next frame of the screen and paints the difference. Damaged lines
+/// get lexed again, even above the viewport, and so do the lines below them
+/// until the lexer state at a line start matches the one from before the
+/// edit: from there on nothing changed, rows are reused. Lines below the
+/// viewport are left alone, a pending relex is picked up once they show up
+void TerminalRenderFrame(Terminal *terminal, u32 line_count) {
+    terminal->frame_pending = false;
+    terminal->frame_at_ms = EventLoopNowMs();
+    TerminalFrameCount += 1;
+
+    // the window of a long cursor line moved, or the cursor left it
+    if (terminal->pos.row < line_count) {
+        u32 column = TerminalCursorColumn(terminal);
+        u32 left = TerminalWindowLeft(terminal, terminal->columns.width, column);
+        if (left != terminal->left || (terminal->pos.row != terminal->left_row && left != 0)) {
+            if (terminal->left_row < line_count) {
+                TerminalDamageLines(terminal, terminal->left_row, terminal->left_row);
+            }
+            TerminalDamageLines(terminal, terminal->pos.row, terminal->pos.row);
+        }
+        terminal->left = left;
+        terminal->left_row = terminal->pos.row;
+    }
+
+    Screen        *screen = &terminal->screen;
+    TerminalDamage damage = terminal->damage;
+    terminal->damage = (TerminalDamage){.first = TERM_DAMAGE_TO_END, .last = 0};
+
+    u32 old_top = terminal->top;
+    u32 cursor_row = terminal->pos.row < line_count ? terminal->pos.row : line_count - 1;
+    u32 top = TerminalViewportTop(terminal, line_count, cursor_row);
+    u32 bottom = terminal->height && top + terminal->height < line_count
+                     ? top + terminal->height
+                     : line_count;
+    terminal->top = top;
+    if (damage.first > damage.last && top == old_top &&
+        bottom - top == ArrayLen(&screen->rows))
+        return;
+
+    TerminalSyncLineStates(terminal);
+    TerminalLineStates *states = &terminal->line_states;
+
+    ScreenBeginFrame(screen);
+    // rows on the screen move along with the viewport, if the terminal can move them
+    u32 base = ScreenScroll(screen, &TerminalOutput, (i64)top - old_top, terminal->height)
+                   ? top
+                   : old_top;
+    bool relex = false;
+    for (u32 line_idx = 0; line_idx < bottom; line_idx += 1) {
+        bool damaged = relex || (line_idx >= damage.first && line_idx <= damage.last);
+        if (!damaged && line_idx < top) continue;
+        i64 old_idx = (line_idx > damage.last ? (i64)line_idx - damage.shift : line_idx) - base;
+        if (!damaged && ScreenHasRow(screen, old_idx)) {
+            ScreenKeepRow(screen, old_idx);
+            continue;
+        }
+
+        // slicing the cursor line whole would move the gap out of it on every key
+        String         line = line_idx == terminal->pos.row
+                                  ? TerminalCursorLineView(terminal)
+                                  : GapBufferNthLine(&terminal->input, line_idx);
+        TokenizerState state = states->buffer[line_idx];
+        if (line_idx < top) {
+            state = TokenizerEndState(&line, state);
+        } else {
+            state = TerminalLayoutLine(terminal, &line, line_idx, state);
+        }
+
+        if (line_idx + 1 < ArrayLen(states)) {
+            relex = !TokenizerStateEqual(states->buffer[line_idx + 1], state);
+            states->buffer[line_idx + 1] = state;
+        }
+    }
+    // the next line starts differently, lex it once it's needed
+    if (relex && bottom < ArrayLen(states)) TerminalDamageLines(terminal, bottom, bottom);
+
+    ScreenEndFrame(screen, &TerminalOutput, terminal->height);
+    ArenaReset(&terminal->scratch);
+}
+
+/// Where the viewport starts so that `row` is on the screen. It moves as
+/// little as it can, but never leaves blank rows below while lines above
+/// could fill them
+u32 TerminalViewportTop(Terminal *terminal, u32 line_count, u32 row) {
+    u32 height = terminal->height ? terminal->height : line_count;
+    u32 top = terminal->top;
+    if (row < top) top = row;
+    if (row >= top + height) top = row - height + 1;
+    if (top + height > line_count) top = line_count > height ? line_count - height : 0;
+    return top;
+}
+
+/// Turns a line of input, prompt included, into a row of styled cells.
+/// Lexing starts in `state`, the state at the end of the line is returned.
+///
+/// Lines too wide for the screen only lay out their window. The one under
+/// the cursor is lexed through checkpoints: from the edit till the states
+/// line up again, then around the window, not the whole line per key.
+///
+/// Windows are in columns: wide graphemes take two cells, and one cut in half
+/// by an edge of the window shows as a space. Cells keep the offset of their
+/// grapheme, that's how the tokens find theirs
+TokenizerState TerminalLayoutLine(Terminal *terminal, String *line, u32 line_idx,
+                                  TokenizerState state) {
+    u32          left = line_idx == terminal->left_row ? terminal->left : 0;
+    Utf8Columns *columns = NULL;
+    u32          width;
+    if (line_idx == terminal->pos.row || left != 0) {
+        columns = TerminalColumns(terminal, line_idx, line);
+        width = columns->width;
+    } else {
+        // the window starts at the line start, how wide the rest is doesn't matter
+        bool wraps = terminal->width <= TERM_PROMPT_LEN + TERM_MIN_WINDOW;
+        width = Utf8TextWidth(line->buffer, line->len, wraps ? UINT32_MAX : terminal->width);
+    }
+    TerminalWindow window = TerminalLineWindow(terminal, width, left);
+
+    TokenizerCheckpoints *checkpoints = &terminal->checkpoints;
+    bool resumable = (window.clipped_left || window.clipped_right) && line_idx == terminal->pos.row;
+    bool restart = resumable && (terminal->checkpoint_line != line_idx ||
+                                 !TokenizerStateEqual(checkpoints->buffer[0].state, state));
+    // only the bytes around the window of the cursor line are in place, laying
+    // it out or lexing it from the start needs all of them. It's short then
+    if (line_idx == terminal->pos.row && (!resumable || restart)) {
+        *line = GapBufferNthLine(&terminal->input, line_idx);
+    }
+    u32            text_at = TERM_PROMPT_LEN + window.clipped_left;
+    u32            row_len = text_at + window.len + window.clipped_right;
+    ScreenCell    *cells = ScreenPushRow(&terminal->screen, row_len);
+    memset(cells, 0, row_len * sizeof(ScreenCell));
+
+    char         *prompt = line_idx == 0 ? TERM_PROMPT_NEW : TERM_PROMPT_CONTINUE;
+    TerminalStyle prompt_style =
+        line_idx == 0 ? TerminalStylePromptNew : TerminalStylePromptContinue;
+    for (u32 i = 0; i < TERM_PROMPT_LEN; i += 1) {
+        /* the space after the prompt is not highlighted */
+        cells[i] = (ScreenCell){.ch = {prompt[i]}, .style = prompt[i] == ' ' ? 0 : prompt_style};
+    }
+
+    // from the grapheme the window starts in
+    u32 offset = 0, column = 0;
+    if (window.left != 0) offset = Utf8ColumnsOffset(columns, line, window.left, &column);
+    u32 window_from = offset;
+    u32 window_end = window.left + window.len;
+
+    ArenaScope scope = ArenaMark(&terminal->scratch);
+    u32       *offsets =
+        ArenaAllocAligned(&terminal->scratch, (window.len + 1) * sizeof(u32), _Alignof(u32));
+    u32  shown = 0;
+    while (column < window_end && offset < line->len) {
+        u32  grapheme_width;
+        u32  next = Utf8NextGrapheme(line->buffer, line->len, offset, &grapheme_width);
+        bool whole = column >= window.left && column + grapheme_width <= window_end;
+        for (u32 i = column; i < column + grapheme_width; i += 1) {
+            if (i < window.left || i >= window_end) continue;
+            ScreenCell *cell = &cells[text_at + i - window.left];
+            offsets[shown++] = offset;
+            if (!whole) {
+                cell->ch[0] = ' ';
+            } else if (i == column && next - offset == 1) {
+                cell->ch[0] = line->buffer[offset];
+            } else if (i == column) {
+                Utf8Display(line->buffer + offset, next - offset, cell->ch, SCREEN_CELL_BYTES);
+            }
+        }
+        column += grapheme_width;
+        offset = next;
+    }
+    u32 window_to = offset;
+    assert(shown == window.len && "the window must be filled");
+
+    if (window.clipped_left) {
+        cells[TERM_PROMPT_LEN] = (ScreenCell){{TERM_OVERFLOW_LEFT}, TerminalStyleOverflow};
+    }
+    if (window.clipped_right) {
+        cells[text_at + window.len] = (ScreenCell){{TERM_OVERFLOW_RIGHT}, TerminalStyleOverflow};
+    }
+
+    Tokenizer      tokenizer = {.input = *line, .state = state};
+    TokenizerState end = {0};
+    if (resumable) {
+        if (restart) {
+            TokenizerCheckpointsReset(checkpoints, state);
+            terminal->checkpoint_line = line_idx;
+        }
+        end = TokenizerCheckpointsUpdate(checkpoints, line);
+        tokenizer = TokenizerCheckpointsSeek(checkpoints, line, window_from);
+    }
+
+    // tokens and cells both go left to right
+    u32   cell = 0;
+    Token t = {0};
+    while ((t = TokenizerNext(&tokenizer)).type) {
+        u32 from = t.s.buffer - line->buffer, to = from + t.s.len;
+        if (resumable && from >= window_to) break;
+
+        TerminalStyle style = TerminalTokenStyles[t.type];
+        if (style == TerminalStyleDefault || to <= window_from || from >= window_to) continue;
+
+        while (cell < shown && offsets[cell] < from)
+            cell += 1;
+        for (u32 i = cell; i < shown && offsets[i] < to; i += 1)
+            cells[text_at + i].style = style;
+    }
+    ArenaRewind(&terminal->scratch, scope);
+    return resumable ? end : tokenizer.state;
+}
+
+/// Which columns of a line `line_width` columns wide fit next to the prompt, starting at `left`
+TerminalWindow TerminalLineWindow(Terminal *terminal, u32 line_width, u32 left) {
+    // the cursor needs a column past the end of the line. Too narrow
+    // a screen for markers and some text, lines just wrap
+    u32 available = terminal->width > TERM_PROMPT_LEN + TERM_MIN_WINDOW
+                        ? terminal->width - TERM_PROMPT_LEN
+                        : 0;
+    if (available == 0 || line_width < available) return (TerminalWindow){.len = line_width};
+
+    TerminalWindow window = {.left = left, .clipped_left = left > 0};
+    // the last column either has the right marker or the cursor after the end
+    u32 span = available - 1 - window.clipped_left;
+    window.len = left + span < line_width ? span : line_width - left;
+    window.clipped_right = left + span < line_width;
+    return window;
+}
+
+/// Where the window of the cursor line starts so that `column` is in it. It
+/// stays put while the cursor is inside, and jumps by half a screen
+/// otherwise, so moving along a long line doesn't repaint it on every key
+u32 TerminalWindowLeft(Terminal *terminal, u32 line_width, u32 column) {
+    u32            left = terminal->pos.row == terminal->left_row ? terminal->left : 0;
+    TerminalWindow window = TerminalLineWindow(terminal, line_width, left);
+    if (!window.clipped_left && !window.clipped_right) return 0;
+
+    bool inside = column < left + window.len || (column == line_width && !window.clipped_right);
+    if (column >= left && inside) return left;
+
+    u32 available = terminal->width - TERM_PROMPT_LEN;
+    left = column > available / 2 ? column - available / 2 : 0;
+    // no blank columns past the end, the cursor after it aside
+    u32 last = line_width + 1 > available - 2 ? line_width + 1 - (available - 2) : 0;
+    return left < last ? left : last;
 }
 
-void TerminalReRenderLinesBelowCursor(Terminal *terminal) {
-    u32 num_lines = StringCount(&terminal->input, '\n') + 1;
-    u32 current_line_idx = terminal->pos.row + 1;
+TerminalStyle TerminalTokenStyle(TokenType type) {
+    switch (type) {
+        case TokenTypeConstantTrue:
+        case TokenTypeConstantFalse:
+        case TokenTypeConstantNone:
+        case TokenTypeNumber:
+            return TerminalStyleNumber;
 
-    /* if this is the last line */
-    if (current_line_idx == num_lines) return;
+        case TokenTypeComment:
+            return TerminalStyleComment;
+
+        case TokenTypeString:
+            return TerminalStyleString;
+
+        default: {
+            if (TokenTypeIsKeyword(type)) return TerminalStyleKeyword;
+            if (TokenTypeIsPunct(type)) return TerminalStylePunct;
+            return TerminalStyleDefault;
+        }
+    }
+}
+
+/// Sets the theme up from `DY_THEME`: an optional preset name, then
+/// styles to override, falling back to the first preset
+void TerminalLoadTheme(void) {
+    char                *spec = getenv(TERM_THEME_ENV);
+    TerminalThemePreset *preset = &TerminalThemes[0];
+    if (spec) {
+        u32 name_len = strcspn(spec, ":");
+        if (memchr(spec, '=', name_len) == NULL) {
+            bool found = false;
+            for (u32 i = 0; i < sizeof(TerminalThemes) / sizeof(TerminalThemePreset); i += 1) {
+                char *name = TerminalThemes[i].name;
+                if (strlen(name) == name_len && memcmp(name, spec, name_len) == 0) {
+                    preset = &TerminalThemes[i];
+                    found = true;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "dy: no theme called `%.*s`\n", name_len, spec);
+            }
+            spec += spec[name_len] ? name_len + 1 : name_len;
+        }
+    }
 
-    for (; current_line_idx < num_lines; current_line_idx += 1) {
-        String next_line = StringNthLine(&terminal->input, current_line_idx);
-        printf("\n");
-        TerminalPrintLineHighlighted(terminal, &next_line, current_line_idx);
+    TerminalTheme = (StyleTheme){0};
+    bool ok = StyleThemeApply(&TerminalTheme, preset->spec, TerminalStyleNames, TerminalStyleCount);
+    assert(ok && "built-in themes must be valid");
+    if (spec && !StyleThemeApply(&TerminalTheme, spec, TerminalStyleNames, TerminalStyleCount)) {
+        fprintf(stderr, "dy: can't make sense of " TERM_THEME_ENV "=%s\n", spec);
     }
+    StyleThemeBake(&TerminalTheme);
 
-    printf("\x1b[%uF\x1b[%uG", num_lines - terminal->pos.row - 1, terminal->pos.col + 5);
+    for (u32 type = 0; type < TokenTypeCount; type += 1)
+        TerminalTokenStyles[type] = TerminalTokenStyle(type);
 }
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <ctype.h>
+
+#include "array.h"
 #include "core.h"
 #include "string.h"
 
+/// Bytes of a line between two lexer checkpoints
+#define TOKENIZER_CHECKPOINT_INTERVAL 256
+
 typedef enum TokenType {
     TokenTypeNone = 0,
 
@@ -101,6 +107,8 @@ typedef enum TokenType {
 
     /// This includes `#` and everything after it til \n
     TokenTypeComment,
+
+    TokenTypeCount,
 } TokenType;
 
 typedef struct Token {
@@ -108,11 +116,55 @@ typedef struct Token {
     String s;
 } Token;
 
+/// What a line leaves open for the next one
+typedef struct TokenizerState {
+    /// Quote of the string that goes on, 0 outside of strings
+    char string_quote;
+    bool string_triple;
+
+    /// The line ends with a backslash
+    bool continuation;
+
+    /// Unclosed (, [ and {
+    u16 bracket_depth;
+} TokenizerState;
+
 typedef struct Tokenizer {
     String input;
     u32 pos;
+
+    /// State at `pos`: set it to the end state of the previous
+    /// line to pick up where that one left off
+    TokenizerState state;
 } Tokenizer;
 
+/// Where the lexer stood at a token start
+typedef struct TokenizerCheckpoint {
+    u32 offset;
+    TokenizerState state;
+} TokenizerCheckpoint;
+
+/// Checkpoints along one long line, about every `TOKENIZER_CHECKPOINT_INTERVAL`
+/// bytes, the first one at its start. Lexing can resume near any offset instead
+/// of at the line start, and after an edit the line is only lexed again up to
+/// where the states line up with the old checkpoints
+typedef struct TokenizerCheckpoints {
+    ArrayHeader header;
+    TokenizerCheckpoint *buffer;
+
+    /// State at the end of the line
+    TokenizerState end;
+
+    /// Edited span since the last update, in current offsets. Checkpoints
+    /// from `dirty` on are unverified, and can only be trusted past `dirty_end`
+    u32 dirty, dirty_end;
+
+    Arena arena;
+
+    /// Unverified checkpoints while the line is lexed again
+    Arena scratch;
+} TokenizerCheckpoints;
+
 static char *PythonKeywords[] = {
     "False",  "True",  "None",  "await",   "else", "import",   "pass",  "break",    "except",
     "in",     "raise", "class", "finally", "is",   "return",   "and",   "continue", "for",
@@ -360,29 +412,43 @@ static TokenType CharToTType[] = {
 };
 
 Token TokenizerNext(Tokenizer *tokenizer);
+TokenizerState TokenizerEndState(String *input, TokenizerState state);
+bool TokenizerStateEqual(TokenizerState a, TokenizerState b);
+bool TokenizerStateIsClosed(TokenizerState state);
+
+void TokenizerCheckpointsReset(TokenizerCheckpoints *checkpoints, TokenizerState start);
+void TokenizerCheckpointsInsert(TokenizerCheckpoints *checkpoints, u32 at, u32 len);
+void TokenizerCheckpointsRemove(TokenizerCheckpoints *checkpoints, u32 at, u32 len);
+u32  TokenizerCheckpointsResume(TokenizerCheckpoints *checkpoints);
+TokenizerState TokenizerCheckpointsUpdate(TokenizerCheckpoints *checkpoints, String *line);
+Tokenizer TokenizerCheckpointsSeek(TokenizerCheckpoints *checkpoints, String *line, u32 offset);
 
 bool TokenTypeIsKeyword(TokenType type);
 
 Token TokenizerNumber(Tokenizer *tokenizer);
 Token TokenizerKeywordOrIdent(Tokenizer *tokenizer);
+Token TokenizerString(Tokenizer *tokenizer, u32 start);
+bool TokenizerIsStringPrefix(String *s);
 
 char TokenizerPeek(Tokenizer *tokenizer);
 char TokenizerConsume(Tokenizer *tokenizer);
 String TokenizerConsumeWhile(Tokenizer *tokenizer, bool (*predicate)(char));
 void TokenizerSkipUntil(Tokenizer *tokenizer, char until);
 
-bool TokenizerIsAtMultiString(Tokenizer *tokenizer);
+bool TokenizerIsAtMultiString(Tokenizer *tokenizer, char quote);
 
 Token TokenizerNext(Tokenizer *tokenizer) {
-    assert(StringCount(&tokenizer->input, '\n') <= 1 && "only one line inputs are supported");
-
     if (tokenizer->pos >= tokenizer->input.len) return (Token){0};
 
     u32 start = tokenizer->pos;
+    // a string left open by the previous line
+    if (tokenizer->state.string_quote) return TokenizerString(tokenizer, start);
+
+    tokenizer->state.continuation = false;
     char current_char = TokenizerPeek(tokenizer);
-    assert(current_char <= 127);
 
-    TokenType ttype = CharToTType[current_char];
+    // bytes outside of ASCII have no one-symbol type
+    TokenType ttype = (u8)current_char <= 127 ? CharToTType[(u8)current_char] : 0;
 
     if (!ttype) {
         if (CharIsDigit(current_char)) {
@@ -396,22 +462,41 @@ Token TokenizerNext(Tokenizer *tokenizer) {
     tokenizer->pos += 1;
     switch (ttype) {
         case TokenTypeHashtag: {
-            tokenizer->pos = StringSearchNthAddOne(&tokenizer->input, 1, '\n');
+            while (tokenizer->pos < tokenizer->input.len && TokenizerPeek(tokenizer) != '\n')
+                tokenizer->pos += 1;
             String token_string = StringSliceFromTo(&tokenizer->input, start, tokenizer->pos);
             return (Token){.type = TokenTypeComment, .s = token_string};
         } break;
 
-        // TODO: parse multi-lines.
-        // TODO: regular lines end at a matching quote or \n
         case TokenTypeDoubleQuote:
         case TokenTypeQuote: {
-            if (TokenizerIsAtMultiString(tokenizer)) {
-                assert(false && "todo: multistrings");
-            }
-            // find a matching quote
-            tokenizer->pos = StringSearchNthAddOne(&tokenizer->input, 2, current_char);
+            tokenizer->state.string_quote = current_char;
+            tokenizer->state.string_triple = TokenizerIsAtMultiString(tokenizer, current_char);
+            if (tokenizer->state.string_triple) tokenizer->pos += 2;
+            return TokenizerString(tokenizer, start);
+        } break;
+
+        case TokenTypeParenhesisOpen:
+        case TokenTypeSquareBracketOpen:
+        case TokenTypeCurlyBracketOpen: {
+            tokenizer->state.bracket_depth += 1;
             String token_string = StringSliceFromTo(&tokenizer->input, start, tokenizer->pos);
-            return (Token){.type = TokenTypeString, .s = token_string};
+            return (Token){.type = ttype, .s = token_string};
+        } break;
+
+        case TokenTypeParenhesisClose:
+        case TokenTypeSquareBracketClose:
+        case TokenTypeCurlyBracketClose: {
+            if (tokenizer->state.bracket_depth != 0) tokenizer->state.bracket_depth -= 1;
+            String token_string = StringSliceFromTo(&tokenizer->input, start, tokenizer->pos);
+            return (Token){.type = ttype, .s = token_string};
+        } break;
+
+        case TokenTypeBackslash: {
+            tokenizer->state.continuation = tokenizer->pos == tokenizer->input.len ||
+                                            TokenizerPeek(tokenizer) == '\n';
+            String token_string = StringSliceFromTo(&tokenizer->input, start, tokenizer->pos);
+            return (Token){.type = ttype, .s = token_string};
         } break;
 
         case TokenTypePunctDot: {
@@ -431,6 +516,204 @@ Token TokenizerNext(Tokenizer *tokenizer) {
     }
 }
 
+/// Lexes the rest of the string opened in `tokenizer->state`, up to its
+/// closing quote or the end of the line. A single-quoted string only goes
+/// on past the line if it ends with a backslash, otherwise it is closed
+/// there (unterminated, Python will complain)
+Token TokenizerString(Tokenizer *tokenizer, u32 start) {
+    TokenizerState *state = &tokenizer->state;
+    String         *input = &tokenizer->input;
+    u32             quotes = state->string_triple ? 3 : 1;
+    bool            closed = false, escaped_newline = false;
+    while (tokenizer->pos < input->len) {
+        char c = TokenizerPeek(tokenizer);
+        if (c == '\\') {
+            /* escapes the next char, even a newline */
+            escaped_newline = tokenizer->pos + 1 == input->len;
+            tokenizer->pos += escaped_newline ? 1 : 2;
+            continue;
+        }
+        if (c == '\n' && !state->string_triple) break;
+
+        tokenizer->pos += 1;
+        if (c != state->string_quote) continue;
+
+        u32 run = 1;
+        while (run < quotes && tokenizer->pos < input->len &&
+               TokenizerPeek(tokenizer) == state->string_quote) {
+            tokenizer->pos += 1;
+            run += 1;
+        }
+        if (run == quotes) {
+            closed = true;
+            break;
+        }
+    }
+
+    if (closed || (!state->string_triple && !escaped_newline)) {
+        state->string_quote = 0;
+        state->string_triple = false;
+    }
+
+    String token_string = StringSliceFromTo(input, start, tokenizer->pos);
+    return (Token){.type = TokenTypeString, .s = token_string};
+}
+
+/// `r`, `b`, `f`, `u` and their valid pairs, in any case
+bool TokenizerIsStringPrefix(String *s) {
+    if (s->len == 0 || s->len > 2) return false;
+
+    char first = tolower(StringGetChar(s, 0));
+    if (s->len == 1) return first == 'r' || first == 'b' || first == 'f' || first == 'u';
+
+    char second = tolower(StringGetChar(s, 1));
+    if (first == 'r') return second == 'b' || second == 'f';
+    if (second == 'r') return first == 'b' || first == 'f';
+    return false;
+}
+
+/// Runs the tokenizer over the whole `input`, starting from `state`
+TokenizerState TokenizerEndState(String *input, TokenizerState state) {
+    Tokenizer tokenizer = {.input = *input, .state = state};
+    while (TokenizerNext(&tokenizer).type) {
+    }
+    return tokenizer.state;
+}
+
+bool TokenizerStateEqual(TokenizerState a, TokenizerState b) {
+    return a.string_quote == b.string_quote && a.string_triple == b.string_triple &&
+           a.continuation == b.continuation && a.bracket_depth == b.bracket_depth;
+}
+
+/// Nothing is left open, a statement ending here is complete
+bool TokenizerStateIsClosed(TokenizerState state) {
+    return !state.string_quote && !state.continuation && state.bracket_depth == 0;
+}
+
+/// Forgets the line, the next update lexes it from `start`
+void TokenizerCheckpointsReset(TokenizerCheckpoints *checkpoints, TokenizerState start) {
+    ArenaReset(&checkpoints->arena);
+    checkpoints->header = (ArrayHeader){0};
+    checkpoints->buffer = NULL;
+    TokenizerCheckpoint first = {.offset = 0, .state = start};
+    ArrayPush(checkpoints, &checkpoints->arena, first);
+    checkpoints->dirty = 0;
+    checkpoints->dirty_end = 0;
+}
+
+/// `len` bytes got inserted at `at`
+void TokenizerCheckpointsInsert(TokenizerCheckpoints *checkpoints, u32 at, u32 len) {
+    // the first one stays at the line start
+    for (u32 i = 1; i < ArrayLen(checkpoints); i += 1) {
+        if (checkpoints->buffer[i].offset >= at) checkpoints->buffer[i].offset += len;
+    }
+    if (at < checkpoints->dirty) checkpoints->dirty = at;
+    if (checkpoints->dirty_end >= at) checkpoints->dirty_end += len;
+    if (checkpoints->dirty_end < at + len) checkpoints->dirty_end = at + len;
+}
+
+/// `len` bytes got removed at `at`
+void TokenizerCheckpointsRemove(TokenizerCheckpoints *checkpoints, u32 at, u32 len) {
+    u32 kept = 1;
+    for (u32 i = 1; i < ArrayLen(checkpoints); i += 1) {
+        TokenizerCheckpoint checkpoint = checkpoints->buffer[i];
+        if (checkpoint.offset >= at && checkpoint.offset < at + len) continue;
+        if (checkpoint.offset >= at + len) checkpoint.offset -= len;
+        checkpoints->buffer[kept++] = checkpoint;
+    }
+    checkpoints->header.len = kept;
+
+    if (at < checkpoints->dirty) checkpoints->dirty = at;
+    if (checkpoints->dirty_end >= at + len) {
+        checkpoints->dirty_end -= len;
+    } else if (checkpoints->dirty_end > at) {
+        checkpoints->dirty_end = at;
+    }
+    if (checkpoints->dirty_end < at) checkpoints->dirty_end = at;
+}
+
+/// The checkpoint the next update lexes from, the last one the edits left alone
+u32 TokenizerCheckpointsResume(TokenizerCheckpoints *checkpoints) {
+    if (checkpoints->dirty == UINT32_MAX) return ArrayLen(checkpoints) - 1;
+    u32 resume = 0;
+    while (resume + 1 < ArrayLen(checkpoints) &&
+           checkpoints->buffer[resume + 1].offset < checkpoints->dirty)
+        resume += 1;
+    return resume;
+}
+
+/// Lexes the line again from the last checkpoint before the edits, and
+/// stops as soon as a token past them starts where an old checkpoint was,
+/// in the same state: the rest of the line lexes as before. Returns the
+/// state at the end of the line
+TokenizerState TokenizerCheckpointsUpdate(TokenizerCheckpoints *checkpoints, String *line) {
+    if (checkpoints->dirty == UINT32_MAX) return checkpoints->end;
+
+    u32 resume = TokenizerCheckpointsResume(checkpoints);
+
+    // set the unverified ones aside, the verified get pushed again
+    ArenaReset(&checkpoints->scratch);
+    u32 stale_len = ArrayLen(checkpoints) - resume - 1;
+    TokenizerCheckpoint *stale = ArenaAllocAligned(&checkpoints->scratch,
+                                                   stale_len * sizeof(TokenizerCheckpoint),
+                                                   _Alignof(TokenizerCheckpoint));
+    memcpy(stale, &checkpoints->buffer[resume + 1], stale_len * sizeof(TokenizerCheckpoint));
+    checkpoints->header.len = resume + 1;
+
+    TokenizerCheckpoint from = checkpoints->buffer[resume];
+    Tokenizer tokenizer = {.input = *line, .pos = from.offset, .state = from.state};
+    u32 next = from.offset + TOKENIZER_CHECKPOINT_INTERVAL;
+    u32 s = 0;
+    bool converged = false;
+    while (tokenizer.pos < line->len) {
+        u32 pos = tokenizer.pos;
+        if (pos >= checkpoints->dirty_end) {
+            while (s < stale_len && stale[s].offset < pos)
+                s += 1;
+            if (s < stale_len && stale[s].offset == pos &&
+                TokenizerStateEqual(stale[s].state, tokenizer.state)) {
+                converged = true;
+                break;
+            }
+        }
+        if (pos >= next) {
+            TokenizerCheckpoint checkpoint = {.offset = pos, .state = tokenizer.state};
+            ArrayPush(checkpoints, &checkpoints->arena, checkpoint);
+            next = pos + TOKENIZER_CHECKPOINT_INTERVAL;
+        }
+        if (!TokenizerNext(&tokenizer).type) break;
+    }
+
+    if (converged) {
+        ArrayEnsureAdditionalCap(checkpoints, &checkpoints->arena, stale_len - s);
+        memcpy(&checkpoints->buffer[ArrayLen(checkpoints)], &stale[s],
+               (stale_len - s) * sizeof(TokenizerCheckpoint));
+        checkpoints->header.len += stale_len - s;
+    } else {
+        checkpoints->end = tokenizer.state;
+    }
+    checkpoints->dirty = UINT32_MAX;
+    checkpoints->dirty_end = 0;
+    return checkpoints->end;
+}
+
+/// A tokenizer at the last checkpoint at or before `offset`, the
+/// checkpoints must be up to date
+Tokenizer TokenizerCheckpointsSeek(TokenizerCheckpoints *checkpoints, String *line, u32 offset) {
+    assert(checkpoints->dirty == UINT32_MAX && "checkpoints must be updated first");
+    u32 low = 0, high = ArrayLen(checkpoints);
+    while (high - low > 1) {
+        u32 middle = low + (high - low) / 2;
+        if (checkpoints->buffer[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    TokenizerCheckpoint checkpoint = checkpoints->buffer[low];
+    return (Tokenizer){.input = *line, .pos = checkpoint.offset, .state = checkpoint.state};
+}
+
 bool TokenTypeIsKeyword(TokenType type) {
     return type >= TokenTypeKeywordAwait && type <= TokenTypeKeywordYield;
 }
@@ -543,11 +826,30 @@ end:
 
 Token TokenizerKeywordOrIdent(Tokenizer *tokenizer) {
     char current_char = TokenizerPeek(tokenizer);
-    assert(CharIsAlnum(current_char));
-    String token_string = TokenizerConsumeWhile(tokenizer, CharIsAlnum);
+    if (!CharIsIdent(current_char)) {
+        // unknown symbol (pasted tab, `@`, `!`...), pass it through as is
+        u32 start = tokenizer->pos;
+        tokenizer->pos += 1;
+        String token_string = StringSliceFromTo(&tokenizer->input, start, tokenizer->pos);
+        return (Token){.type = TokenTypeIdent, .s = token_string};
+    }
+    u32    start = tokenizer->pos;
+    String token_string = TokenizerConsumeWhile(tokenizer, CharIsIdent);
     assert(token_string.len > 0 && "identifiers are at least 1 char long");
     assert(StringCount(&token_string, '\n') == 0 && "tokens should be on one line");
 
+    // string prefix, as in f"..." or rb'...'
+    if (tokenizer->pos < tokenizer->input.len && TokenizerIsStringPrefix(&token_string)) {
+        char quote = TokenizerPeek(tokenizer);
+        if (quote == '"' || quote == '\'') {
+            tokenizer->pos += 1;
+            tokenizer->state.string_quote = quote;
+            tokenizer->state.string_triple = TokenizerIsAtMultiString(tokenizer, quote);
+            if (tokenizer->state.string_triple) tokenizer->pos += 2;
+            return TokenizerString(tokenizer, start);
+        }
+    }
+
     for (u32 i = 0; i < sizeof(PythonKeywords) / sizeof(char *); i += 1) {
         u32 len = strlen(PythonKeywords[i]);
         if (len != token_string.len) continue;
@@ -580,11 +882,12 @@ String TokenizerConsumeWhile(Tokenizer *tokenizer, bool (*Predicate)(char)) {
     return StringSliceFromTo(&tokenizer->input, start, tokenizer->pos);
 }
 
-bool TokenizerIsAtMultiString(Tokenizer *tokenizer) {
-    // multistring starts with """
-    if (tokenizer->pos + 2 >= tokenizer->input.len) return false;
+/// Called past the opening `quote`: are the next two the same?
+bool TokenizerIsAtMultiString(Tokenizer *tokenizer, char quote) {
+    // multistring starts with """ or '''
+    if (tokenizer->pos + 2 > tokenizer->input.len) return false;
     for (u32 i = 0; i < 2; i += 1) {
-        if (StringGetChar(&tokenizer->input, tokenizer->pos + i) != '"') {
+        if (StringGetChar(&tokenizer->input, tokenizer->pos + i) != quote) {
             return false;
         }
     }
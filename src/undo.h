@@ -0,0 +1,161 @@
+#pragma once
+
+#include <assert.h>
+#include <memory.h>
+
+#include "arena.h"
+#include "core.h"
+
+/// No op at all, as in the one before the first
+#define UNDO_NONE UINT32_MAX
+
+typedef enum UndoKind {
+    UndoInsert = 0,
+    UndoRemove,
+} UndoKind;
+
+/// Keys whose edits add up to a single step, while they keep coming
+typedef enum UndoRun {
+    /// Every edit is a step on its own
+    UndoRunNone = 0,
+    UndoRunTyping,
+    UndoRunBackspace,
+    UndoRunDelete,
+} UndoRun;
+
+/// An edit of the buffer, followed by the `len` bytes it inserted or removed,
+/// padded to `UndoOp`'s alignment
+typedef struct UndoOp {
+    /// Where the previous op starts in the log, `UNDO_NONE` for the first one
+    u32 prev;
+
+    /// The bytes were inserted at or removed from `offset` of the buffer
+    u32 offset, len;
+
+    /// Where the cursor was before the step this op starts
+    u32 cursor;
+
+    u8   kind;
+    bool starts_step;
+} UndoOp;
+
+/// Edits of the input, in the order they were made, so that they can be
+/// reverted and made again. Ops are packed one after another in the arena:
+/// the ones before `applied` are in effect, the ones after it were undone
+/// and can be redone until something else gets edited.
+///
+/// Keys are grouped into steps, undo and redo go a step at a time. Inserts
+/// right after the previous one get merged into it, so typing a line takes
+/// a single op.
+///
+/// Ops are found by their offset from the arena's start, and dropping the
+/// ones that could be redone sets its `allocated` back. Both only hold while
+/// the arena has a single chunk, 4 GiB of edits: the log asserts it never
+/// gets a second one
+typedef struct UndoLog {
+    Arena arena;
+    u32   applied;
+
+    /// Last op in effect, `UNDO_NONE` if there is none
+    u32 last;
+
+    /// Run of the key being applied, and whether its edits start a new step
+    UndoRun run;
+    bool    step_open;
+} UndoLog;
+
+void    UndoLogClear(UndoLog *this);
+void    UndoLogBeginStep(UndoLog *this, UndoRun run);
+void    UndoLogRecord(UndoLog *this, UndoKind kind, u32 offset, char *text, u32 len, u32 cursor);
+UndoOp *UndoLogBack(UndoLog *this);
+UndoOp *UndoLogForward(UndoLog *this, bool first);
+UndoOp *UndoLogAt(UndoLog *this, u32 at);
+u32     UndoOpSize(u32 len);
+char   *UndoOpText(UndoOp *op);
+
+void UndoLogClear(UndoLog *this) {
+    ArenaReset(&this->arena);
+    this->applied = 0;
+    this->last = UNDO_NONE;
+    this->run = UndoRunNone;
+    this->step_open = false;
+}
+
+/// Called for every key: its edits join the current step if
+/// it's part of the same run, otherwise they start a new one
+void UndoLogBeginStep(UndoLog *this, UndoRun run) {
+    if (run == UndoRunNone || run != this->run) this->step_open = false;
+    this->run = run;
+}
+
+/// Appends an op, dropping the ops that could be redone. `cursor` is
+/// where the cursor was before the edit, it's kept if the op starts a step
+void UndoLogRecord(UndoLog *this, UndoKind kind, u32 offset, char *text, u32 len, u32 cursor) {
+    if (len == 0) return;
+    this->arena.allocated = this->applied;
+
+    // typing on: the text goes at the end of the last op, which is the last thing in the arena
+    UndoOp *last = this->last != UNDO_NONE ? UndoLogAt(this, this->last) : NULL;
+    if (this->step_open && last && kind == UndoInsert && last->kind == UndoInsert &&
+        offset == last->offset + last->len) {
+        ArenaAlloc(&this->arena, UndoOpSize(last->len + len) - UndoOpSize(last->len));
+        assert(this->arena.chunk->prev == NULL && "undo log outgrew its chunk");
+        memcpy(UndoOpText(last) + last->len, text, len);
+        last->len += len;
+        this->applied = this->arena.allocated;
+        return;
+    }
+
+    u32     at = this->arena.allocated;
+    UndoOp *op = ArenaAlloc(&this->arena, UndoOpSize(len));
+    assert(this->arena.chunk->prev == NULL && "undo log outgrew its chunk");
+    *op = (UndoOp){
+        .prev = this->last,
+        .offset = offset,
+        .len = len,
+        .cursor = cursor,
+        .kind = kind,
+        .starts_step = !this->step_open,
+    };
+    memcpy(UndoOpText(op), text, len);
+    this->last = at;
+    this->applied = this->arena.allocated;
+    this->step_open = true;
+}
+
+/// Takes the last op in effect out of it and returns it, NULL if there is
+/// none. The caller reverts it, and keeps going until an op starts a step
+UndoOp *UndoLogBack(UndoLog *this) {
+    if (this->last == UNDO_NONE) return NULL;
+    UndoOp *op = UndoLogAt(this, this->last);
+    this->applied = this->last;
+    this->last = op->prev;
+    this->step_open = false;
+    return op;
+}
+
+/// Puts the next undone op back into effect and returns it, NULL if there is
+/// none. Only the `first` op of a step may start one: the caller redoes ops
+/// till the next step
+UndoOp *UndoLogForward(UndoLog *this, bool first) {
+    if (this->applied == this->arena.allocated) return NULL;
+    UndoOp *op = UndoLogAt(this, this->applied);
+    if (!first && op->starts_step) return NULL;
+    this->last = this->applied;
+    this->applied += UndoOpSize(op->len);
+    this->step_open = false;
+    return op;
+}
+
+UndoOp *UndoLogAt(UndoLog *this, u32 at) {
+    assert(at < this->arena.allocated && "undo op out of the log");
+    assert(this->arena.chunk->prev == NULL && "undo log outgrew its chunk");
+    return (UndoOp *)(this->arena.ptr + at);
+}
+
+u32 UndoOpSize(u32 len) {
+    u32 align = _Alignof(UndoOp);
+    return sizeof(UndoOp) + (len + align - 1) / align * align;
+}
+
+char *UndoOpText(UndoOp *op) { return (char *)(op + 1); }
@@ -0,0 +1,495 @@
+#pragma once
+
+#include <assert.h>
+#include <memory.h>
+
+#include "arena.h"
+#include "array.h"
+#include "core.h"
+#include "string.h"
+
+/// Checkpoints of a column map are about this many bytes apart
+#define UTF8_COLUMNS_INTERVAL 256
+
+/// What invalid bytes decode to, and how it's printed
+#define UTF8_REPLACEMENT       0xFFFD
+#define UTF8_REPLACEMENT_BYTES "\xEF\xBF\xBD"
+
+#define UTF8_ZWJ 0x200D
+
+typedef struct Utf8Range {
+    u32 first, last;
+} Utf8Range;
+
+/// Code points that extend the grapheme before them and take no column:
+/// combining marks, joiners, variation selectors, emoji modifiers and tags
+static Utf8Range Utf8ExtendRanges[] = {
+    {0x0300, 0x036F},   {0x0483, 0x0489},   {0x0591, 0x05BD},   {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2},   {0x05C4, 0x05C5},   {0x05C7, 0x05C7},   {0x0610, 0x061A},
+    {0x064B, 0x065F},   {0x0670, 0x0670},   {0x06D6, 0x06DC},   {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8},   {0x06EA, 0x06ED},   {0x0711, 0x0711},   {0x0730, 0x074A},
+    {0x07A6, 0x07B0},   {0x07EB, 0x07F3},   {0x0816, 0x082D},   {0x0859, 0x085B},
+    {0x08D3, 0x08E1},   {0x08E3, 0x0903},   {0x093A, 0x093C},   {0x093E, 0x094F},
+    {0x0951, 0x0957},   {0x0962, 0x0963},   {0x0981, 0x0983},   {0x09BC, 0x09BC},
+    {0x09BE, 0x09CD},   {0x09D7, 0x09D7},   {0x09E2, 0x09E3},   {0x0A01, 0x0A03},
+    {0x0A3C, 0x0A51},   {0x0A70, 0x0A71},   {0x0A75, 0x0A75},   {0x0A81, 0x0A83},
+    {0x0ABC, 0x0ACD},   {0x0AE2, 0x0AE3},   {0x0B01, 0x0B03},   {0x0B3C, 0x0B57},
+    {0x0B62, 0x0B63},   {0x0B82, 0x0B82},   {0x0BBE, 0x0BCD},   {0x0BD7, 0x0BD7},
+    {0x0C00, 0x0C04},   {0x0C3E, 0x0C56},   {0x0C62, 0x0C63},   {0x0C81, 0x0C83},
+    {0x0CBC, 0x0CD6},   {0x0CE2, 0x0CE3},   {0x0D00, 0x0D03},   {0x0D3B, 0x0D3C},
+    {0x0D3E, 0x0D4D},   {0x0D57, 0x0D57},   {0x0D62, 0x0D63},   {0x0D82, 0x0D83},
+    {0x0DCA, 0x0DDF},   {0x0DF2, 0x0DF3},   {0x0E31, 0x0E31},   {0x0E34, 0x0E3A},
+    {0x0E47, 0x0E4E},   {0x0EB1, 0x0EB1},   {0x0EB4, 0x0EBC},   {0x0EC8, 0x0ECD},
+    {0x0F18, 0x0F19},   {0x0F35, 0x0F35},   {0x0F37, 0x0F37},   {0x0F39, 0x0F39},
+    {0x0F3E, 0x0F3F},   {0x0F71, 0x0F84},   {0x0F86, 0x0F87},   {0x0F8D, 0x0FBC},
+    {0x0FC6, 0x0FC6},   {0x102B, 0x103E},   {0x1056, 0x1059},   {0x105E, 0x1060},
+    {0x1062, 0x1064},   {0x1067, 0x106D},   {0x1071, 0x1074},   {0x1082, 0x108D},
+    {0x108F, 0x108F},   {0x109A, 0x109D},   {0x1160, 0x11FF},   {0x135D, 0x135F},
+    {0x1712, 0x1714},   {0x1732, 0x1734},   {0x1752, 0x1753},   {0x1772, 0x1773},
+    {0x17B4, 0x17D3},   {0x17DD, 0x17DD},   {0x180B, 0x180D},   {0x1885, 0x1886},
+    {0x18A9, 0x18A9},   {0x1920, 0x193B},   {0x1A17, 0x1A1B},   {0x1A55, 0x1A7F},
+    {0x1AB0, 0x1AFF},   {0x1B00, 0x1B04},   {0x1B34, 0x1B44},   {0x1B6B, 0x1B73},
+    {0x1B80, 0x1B82},   {0x1BA1, 0x1BAD},   {0x1BE6, 0x1BF3},   {0x1C24, 0x1C37},
+    {0x1CD0, 0x1CD2},   {0x1CD4, 0x1CE8},   {0x1CED, 0x1CED},   {0x1CF4, 0x1CF4},
+    {0x1CF7, 0x1CF9},   {0x1DC0, 0x1DFF},   {0x200B, 0x200D},   {0x20D0, 0x20F0},
+    {0x2CEF, 0x2CF1},   {0x2D7F, 0x2D7F},   {0x2DE0, 0x2DFF},   {0x302A, 0x302F},
+    {0x3099, 0x309A},   {0xA66F, 0xA672},   {0xA674, 0xA67D},   {0xA69E, 0xA69F},
+    {0xA6F0, 0xA6F1},   {0xA802, 0xA802},   {0xA806, 0xA806},   {0xA80B, 0xA80B},
+    {0xA823, 0xA827},   {0xA82C, 0xA82C},   {0xA880, 0xA881},   {0xA8B4, 0xA8C5},
+    {0xA8E0, 0xA8F1},   {0xA8FF, 0xA8FF},   {0xA926, 0xA92D},   {0xA947, 0xA953},
+    {0xA980, 0xA983},   {0xA9B3, 0xA9C0},   {0xA9E5, 0xA9E5},   {0xAA29, 0xAA36},
+    {0xAA43, 0xAA43},   {0xAA4C, 0xAA4D},   {0xAA7B, 0xAA7D},   {0xAAB0, 0xAAB0},
+    {0xAAB2, 0xAAB4},   {0xAAB7, 0xAAB8},   {0xAABE, 0xAABF},   {0xAAC1, 0xAAC1},
+    {0xAAEB, 0xAAEF},   {0xAAF5, 0xAAF6},   {0xABE3, 0xABEA},   {0xABEC, 0xABED},
+    {0xD7B0, 0xD7FF},   {0xFB1E, 0xFB1E},   {0xFE00, 0xFE0F},   {0xFE20, 0xFE2F},
+    {0x1D165, 0x1D169}, {0x1D16D, 0x1D172}, {0x1D17B, 0x1D182}, {0x1D185, 0x1D18B},
+    {0x1D1AA, 0x1D1AD}, {0x1F3FB, 0x1F3FF}, {0xE0000, 0xE0FFF},
+};
+
+/// East Asian wide and fullwidth code points, and emoji that
+/// terminals show as such: they take two columns
+static Utf8Range Utf8WideRanges[] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},   {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0},   {0x23F3, 0x23F3},   {0x25FD, 0x25FE},   {0x2614, 0x2615},
+    {0x2648, 0x2653},   {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},   {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4},   {0x26EA, 0x26EA},   {0x26F2, 0x26F3},   {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA},   {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},   {0x2753, 0x2755},
+    {0x2757, 0x2757},   {0x2795, 0x2797},   {0x27B0, 0x27B0},   {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C},   {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x303E},
+    {0x3041, 0x3247},   {0x3250, 0x4DBF},   {0x4E00, 0xA4CF},   {0xA960, 0xA97F},
+    {0xAC00, 0xD7A3},   {0xF900, 0xFAFF},   {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE4}, {0x17000, 0x18CFF},
+    {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E},
+    {0x1F191, 0x1F19A}, {0x1F1E6, 0x1F1FF}, {0x1F200, 0x1F202}, {0x1F210, 0x1F23B},
+    {0x1F240, 0x1F248}, {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F320},
+    {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+    {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E},
+    {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+    {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4},
+    {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2},
+    {0x1F6D5, 0x1F6D7}, {0x1F6DC, 0x1F6DF}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC},
+    {0x1F7E0, 0x1F7EB}, {0x1F7F0, 0x1F7F0}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945},
+    {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+/// Code points that would mess with the terminal if printed as is:
+/// C1 controls, bidi marks, embeddings and isolates, the BOM
+static Utf8Range Utf8ControlRanges[] = {
+    {0x0080, 0x009F}, {0x200E, 0x200F}, {0x2028, 0x202E}, {0x2066, 0x2069}, {0xFEFF, 0xFEFF},
+};
+
+typedef struct Utf8Column {
+    u32 offset, column;
+} Utf8Column;
+
+/// Columns along one line. The first checkpoint is at its start, the others
+/// about every `UTF8_COLUMNS_INTERVAL` bytes, at breaks between graphemes that
+/// nothing before them can move. The column of an offset, or the offset of a
+/// column, is found by scanning from the closest checkpoint instead of the line
+/// start, and after an edit the line is only scanned again up to where the old
+/// checkpoints line up
+typedef struct Utf8Columns {
+    ArrayHeader header;
+    Utf8Column *buffer;
+
+    /// Columns the whole line takes
+    u32 width;
+
+    /// Edited span since the last update, as in `TokenizerCheckpoints`
+    u32 dirty, dirty_end;
+
+    Arena arena;
+
+    /// Unverified checkpoints while the line is scanned again
+    Arena scratch;
+} Utf8Columns;
+
+u32  Utf8Decode(char *text, u32 len, u32 *code_point);
+u32  Utf8PrevCodePoint(char *text, u32 at);
+bool Utf8InRanges(u32 code_point, Utf8Range *ranges, u32 count);
+bool Utf8IsExtend(u32 code_point);
+bool Utf8IsControl(u32 code_point);
+bool Utf8IsRegional(u32 code_point);
+bool Utf8IsPictographic(u32 code_point);
+u32  Utf8Width(u32 code_point);
+
+u32  Utf8NextGrapheme(char *text, u32 len, u32 at, u32 *width);
+u32  Utf8PrevGrapheme(char *text, u32 at);
+bool Utf8IsStableBreak(char *text, u32 len, u32 at);
+u32  Utf8TextWidth(char *text, u32 len, u32 limit);
+u32  Utf8Display(char *grapheme, u32 len, char *out, u32 cap);
+
+void Utf8ColumnsReset(Utf8Columns *this);
+void Utf8ColumnsInsert(Utf8Columns *this, u32 at, u32 len);
+void Utf8ColumnsRemove(Utf8Columns *this, u32 at, u32 len);
+u32  Utf8ColumnsResume(Utf8Columns *this);
+void Utf8ColumnsUpdate(Utf8Columns *this, String *line);
+u32  Utf8ColumnsOf(Utf8Columns *this, String *line, u32 offset);
+u32  Utf8ColumnsOffset(Utf8Columns *this, String *line, u32 column, u32 *start);
+
+/// Decodes the code point `text` starts with, returns its length. Invalid,
+/// overlong or truncated sequences are a byte long and decode to U+FFFD
+u32 Utf8Decode(char *text, u32 len, u32 *code_point) {
+    assert(len > 0);
+    u8 *bytes = (u8 *)text;
+    u8  lead = bytes[0];
+    *code_point = lead;
+    if (lead < 0x80) return 1;
+
+    u32 need, min, decoded;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        need = 1, min = 0x80, decoded = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        need = 2, min = 0x800, decoded = lead & 0x0F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        need = 3, min = 0x10000, decoded = lead & 0x07;
+    } else {
+        goto invalid;
+    }
+    if (need >= len) goto invalid;
+    for (u32 i = 1; i <= need; i += 1) {
+        if ((bytes[i] & 0xC0) != 0x80) goto invalid;
+        decoded = decoded << 6 | (bytes[i] & 0x3F);
+    }
+    if (decoded < min || decoded > 0x10FFFF || (decoded >= 0xD800 && decoded <= 0xDFFF)) {
+        goto invalid;
+    }
+    *code_point = decoded;
+    return need + 1;
+
+invalid:
+    *code_point = UTF8_REPLACEMENT;
+    return 1;
+}
+
+/// Start of the code point that ends at `at`, as `Utf8Decode` would split the text
+u32 Utf8PrevCodePoint(char *text, u32 at) {
+    assert(at > 0);
+    u32 start = at - 1;
+    while (start > 0 && at - start < 4 && ((u8)text[start] & 0xC0) == 0x80)
+        start -= 1;
+    u32 code_point;
+    return Utf8Decode(text + start, at - start, &code_point) == at - start ? start : at - 1;
+}
+
+bool Utf8InRanges(u32 code_point, Utf8Range *ranges, u32 count) {
+    if (code_point < ranges[0].first || code_point > ranges[count - 1].last) return false;
+    u32 low = 0, high = count;
+    while (low < high) {
+        u32 mid = low + (high - low) / 2;
+        if (code_point > ranges[mid].last) {
+            low = mid + 1;
+        } else if (code_point < ranges[mid].first) {
+            high = mid;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Utf8IsExtend(u32 code_point) {
+    return code_point >= 0x300 &&
+           Utf8InRanges(code_point, Utf8ExtendRanges,
+                        sizeof(Utf8ExtendRanges) / sizeof(Utf8ExtendRanges[0]));
+}
+
+bool Utf8IsControl(u32 code_point) {
+    return code_point >= 0x80 &&
+           Utf8InRanges(code_point, Utf8ControlRanges,
+                        sizeof(Utf8ControlRanges) / sizeof(Utf8ControlRanges[0]));
+}
+
+/// Flags are pairs of these
+bool Utf8IsRegional(u32 code_point) { return code_point >= 0x1F1E6 && code_point <= 0x1F1FF; }
+
+/// Roughly, what a zero width joiner glues together into a single emoji
+bool Utf8IsPictographic(u32 code_point) {
+    return (code_point >= 0x2600 && code_point <= 0x27BF) ||
+           (code_point >= 0x1F000 && code_point <= 0x1FAFF);
+}
+
+/// Columns the code point takes on its own
+u32 Utf8Width(u32 code_point) {
+    if (code_point < 0x300) return 1;
+    u32 wide_count = sizeof(Utf8WideRanges) / sizeof(Utf8WideRanges[0]);
+    if (Utf8InRanges(code_point, Utf8WideRanges, wide_count)) return 2;
+    return Utf8IsExtend(code_point) ? 0 : 1;
+}
+
+/// End of the grapheme that starts at `at`, with the columns it takes.
+/// A simplified take on Unicode's rules: marks and joiners stick to the
+/// code point before them, so do emoji joined by a ZWJ and flag pairs
+u32 Utf8NextGrapheme(char *text, u32 len, u32 at, u32 *width) {
+    assert(at < len);
+    // ASCII followed by ASCII, most of the time
+    if ((u8)text[at] < 0x80 && (at + 1 == len || (u8)text[at + 1] < 0x80)) {
+        *width = 1;
+        return at + 1;
+    }
+
+    u32 base;
+    u32 end = at + Utf8Decode(text + at, len - at, &base);
+    // a stray mark gets a column of its own
+    *width = Utf8Width(base) ? Utf8Width(base) : 1;
+
+    u32  prev = base;
+    bool flag_open = Utf8IsRegional(base);
+    while (end < len) {
+        u32  next;
+        u32  next_len = Utf8Decode(text + end, len - end, &next);
+        bool joins = Utf8IsExtend(next) || (prev == UTF8_ZWJ && Utf8IsPictographic(next)) ||
+                     (flag_open && Utf8IsRegional(next));
+        if (!joins) break;
+        flag_open = false;
+        prev = next;
+        end += next_len;
+    }
+    return end;
+}
+
+/// Start of the grapheme that ends at `at`. It's found going forward from
+/// the closest break before it that doesn't depend on what precedes it
+u32 Utf8PrevGrapheme(char *text, u32 at) {
+    u32 from = Utf8PrevCodePoint(text, at);
+    while (from > 0 && !Utf8IsStableBreak(text, at, from))
+        from = Utf8PrevCodePoint(text, from);
+
+    u32 start = from, width;
+    while (true) {
+        u32 end = Utf8NextGrapheme(text, at, start, &width);
+        if (end >= at) return start;
+        start = end;
+    }
+}
+
+/// Whether graphemes break at `at` no matter what comes before: the code
+/// point there starts one for sure, and no emoji or flag goes on over it
+bool Utf8IsStableBreak(char *text, u32 len, u32 at) {
+    if (at == 0 || at >= len) return true;
+    if ((u8)text[at - 1] < 0x80 && (u8)text[at] < 0x80) return true;
+
+    u32 before, after;
+    u32 before_at = Utf8PrevCodePoint(text, at);
+    Utf8Decode(text + before_at, at - before_at, &before);
+    Utf8Decode(text + at, len - at, &after);
+    return !Utf8IsExtend(after) && before != UTF8_ZWJ &&
+           !(Utf8IsRegional(before) && Utf8IsRegional(after));
+}
+
+/// Columns `text` takes, counted only until they reach `limit`
+u32 Utf8TextWidth(char *text, u32 len, u32 limit) {
+    u32 at = 0, width = 0;
+    while (at < len && width < limit) {
+        u32 grapheme_width;
+        at = Utf8NextGrapheme(text, len, at, &grapheme_width);
+        width += grapheme_width;
+    }
+    return width;
+}
+
+/// Writes what to print for a grapheme into `out`, as many of its code points
+/// as fit into `cap` bytes, returns how many bytes that is. Invalid bytes and
+/// control code points show up as U+FFFD, a stray mark gets a space to sit on
+u32 Utf8Display(char *grapheme, u32 len, char *out, u32 cap) {
+    u32 written = 0;
+    for (u32 at = 0; at < len;) {
+        u32   code_point;
+        u32   code_point_len = Utf8Decode(grapheme + at, len - at, &code_point);
+        char *bytes = grapheme + at;
+        u32   bytes_len = code_point_len;
+        if (code_point == UTF8_REPLACEMENT || Utf8IsControl(code_point)) {
+            bytes = UTF8_REPLACEMENT_BYTES;
+            bytes_len = sizeof(UTF8_REPLACEMENT_BYTES) - 1;
+        }
+        if (at == 0 && Utf8Width(code_point) == 0 && cap > 0) out[written++] = ' ';
+        if (written + bytes_len > cap) break;
+
+        memcpy(out + written, bytes, bytes_len);
+        written += bytes_len;
+        at += code_point_len;
+    }
+    return written;
+}
+
+/// Forgets the line, the next update scans it from the start
+void Utf8ColumnsReset(Utf8Columns *this) {
+    ArenaReset(&this->arena);
+    this->header = (ArrayHeader){0};
+    this->buffer = NULL;
+    Utf8Column first = {.offset = 0, .column = 0};
+    ArrayPush(this, &this->arena, first);
+    this->width = 0;
+    this->dirty = 0;
+    this->dirty_end = 0;
+}
+
+/// `len` bytes got inserted at `at`
+void Utf8ColumnsInsert(Utf8Columns *this, u32 at, u32 len) {
+    // the first one stays at the line start
+    for (u32 i = 1; i < ArrayLen(this); i += 1) {
+        if (this->buffer[i].offset >= at) this->buffer[i].offset += len;
+    }
+    if (at < this->dirty) this->dirty = at;
+    if (this->dirty_end >= at) this->dirty_end += len;
+    if (this->dirty_end < at + len) this->dirty_end = at + len;
+}
+
+/// `len` bytes got removed at `at`
+void Utf8ColumnsRemove(Utf8Columns *this, u32 at, u32 len) {
+    u32 kept = 1;
+    for (u32 i = 1; i < ArrayLen(this); i += 1) {
+        Utf8Column checkpoint = this->buffer[i];
+        if (checkpoint.offset >= at && checkpoint.offset < at + len) continue;
+        if (checkpoint.offset >= at + len) checkpoint.offset -= len;
+        this->buffer[kept++] = checkpoint;
+    }
+    this->header.len = kept;
+
+    if (at < this->dirty) this->dirty = at;
+    if (this->dirty_end >= at + len) {
+        this->dirty_end -= len;
+    } else if (this->dirty_end > at) {
+        this->dirty_end = at;
+    }
+    if (this->dirty_end < at) this->dirty_end = at;
+}
+
+/// The checkpoint the next update scans from, the last one the edits left alone
+u32 Utf8ColumnsResume(Utf8Columns *this) {
+    if (this->dirty == UINT32_MAX) return ArrayLen(this) - 1;
+    // whether a checkpoint is a stable break depends on the code point before it too
+    u32 resume = 0;
+    while (resume + 1 < ArrayLen(this) && this->buffer[resume + 1].offset + 4 < this->dirty)
+        resume += 1;
+    return resume;
+}
+
+/// Scans the line again from the last checkpoint before the edits, and stops
+/// at the first old checkpoint past them that is still a stable break: the
+/// rest of the line takes the same columns as before, only shifted
+void Utf8ColumnsUpdate(Utf8Columns *this, String *line) {
+    if (this->dirty == UINT32_MAX) return;
+
+    u32 resume = Utf8ColumnsResume(this);
+
+    // set the unverified ones aside, the verified get pushed again
+    ArenaReset(&this->scratch);
+    u32         stale_len = ArrayLen(this) - resume - 1;
+    Utf8Column *stale =
+        ArenaAllocAligned(&this->scratch, stale_len * sizeof(Utf8Column), _Alignof(Utf8Column));
+    memcpy(stale, &this->buffer[resume + 1], stale_len * sizeof(Utf8Column));
+    this->header.len = resume + 1;
+
+    Utf8Column from = this->buffer[resume];
+    u32        at = from.offset, column = from.column;
+    u32        next = at + UTF8_COLUMNS_INTERVAL;
+    u32        s = 0;
+    bool       converged = false;
+    while (at < line->len) {
+        if (at >= this->dirty_end) {
+            while (s < stale_len && stale[s].offset < at)
+                s += 1;
+            if (s < stale_len && stale[s].offset == at &&
+                Utf8IsStableBreak(line->buffer, line->len, at)) {
+                converged = true;
+                break;
+            }
+        }
+        if (at >= next && Utf8IsStableBreak(line->buffer, line->len, at)) {
+            Utf8Column checkpoint = {.offset = at, .column = column};
+            ArrayPush(this, &this->arena, checkpoint);
+            next = at + UTF8_COLUMNS_INTERVAL;
+        }
+        u32 width;
+        at = Utf8NextGrapheme(line->buffer, line->len, at, &width);
+        column += width;
+    }
+
+    if (converged) {
+        u32 old_column = stale[s].column;
+        ArrayEnsureAdditionalCap(this, &this->arena, stale_len - s);
+        for (u32 i = s; i < stale_len; i += 1) {
+            Utf8Column checkpoint = {stale[i].offset, stale[i].column - old_column + column};
+            this->buffer[this->header.len++] = checkpoint;
+        }
+        this->width = this->width - old_column + column;
+    } else {
+        this->width = column;
+    }
+    this->dirty = UINT32_MAX;
+    this->dirty_end = 0;
+}
+
+/// Column of the grapheme at `offset`, the map must be up to date
+u32 Utf8ColumnsOf(Utf8Columns *this, String *line, u32 offset) {
+    assert(this->dirty == UINT32_MAX && "columns must be updated first");
+    u32 low = 0, high = ArrayLen(this);
+    while (high - low > 1) {
+        u32 middle = low + (high - low) / 2;
+        if (this->buffer[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+
+    u32 at = this->buffer[low].offset, column = this->buffer[low].column;
+    while (at < offset) {
+        u32 width;
+        u32 next = Utf8NextGrapheme(line->buffer, line->len, at, &width);
+        if (next > offset) break;
+        at = next;
+        column += width;
+    }
+    return column;
+}
+
+/// Offset of the grapheme that covers `column`, the line's length past its end.
+/// `start` gets the column the grapheme starts at, which is before `column` if
+/// it's a wide one. The map must be up to date
+u32 Utf8ColumnsOffset(Utf8Columns *this, String *line, u32 column, u32 *start) {
+    assert(this->dirty == UINT32_MAX && "columns must be updated first");
+    u32 low = 0, high = ArrayLen(this);
+    while (high - low > 1) {
+        u32 middle = low + (high - low) / 2;
+        if (this->buffer[middle].column <= column) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+
+    u32 at = this->buffer[low].offset, at_column = this->buffer[low].column;
+    while (at < line->len) {
+        u32 width;
+        u32 next = Utf8NextGrapheme(line->buffer, line->len, at, &width);
+        if (at_column + width > column) break;
+        at = next;
+        at_column += width;
+    }
+    if (start) *start = at_column;
+    return at;
+}